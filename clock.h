@@ -15,6 +15,9 @@ double mhz(int verbose);
 /* Determine clock rate of processor, having more control over accuracy */
 double mhz_full(int verbose, int sleeptime);
 
+/* Determine clock rate quickly by calibrating against gettimeofday */
+double mhz_fast(int verbose);
+
 /** Special counters that compensate for timer interrupt overhead */
 
 void start_comp_counter();
@@ -21,15 +21,15 @@ void init_fsecs(void)
 
 #if USE_FCYC
     if (verbose)
-	printf("Measuring performance with a cycle counter.\n");
+	printf("Measuring performance with a cycle counter (K-best).\n");
 
     /* set key parameters for the fcyc package */
-    set_fcyc_maxsamples(20); 
+    set_fcyc_maxsamples(20);
     set_fcyc_clear_cache(1);
     set_fcyc_compensate(1);
     set_fcyc_epsilon(0.01);
     set_fcyc_k(3);
-    Mhz = mhz(verbose > 0);
+    Mhz = mhz_fast(verbose > 0);
 #elif USE_ITIMER
     if (verbose)
 	printf("Measuring performance with the interval timer.\n");
@@ -15,10 +15,16 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "fcyc.h"
+#include "clock.h"
 #include "config.h"
 
 /**********************
@@ -29,26 +35,36 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MAXWORKERS    32 /* max parallel replay threads (-j) */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
 
 /******************************
  * The key compound data types
  *****************************/
 
-/* Records the extent of each block's payload */
+/* Records the extent of one block's payload. The records live in a
+   pool with one slot per block id (ids are dense, and at most one
+   block per id is live at a time), so looking a block up by id is one
+   index. Live records are additionally linked into a treap keyed by
+   payload address, which makes the overlap check on every allocation
+   O(log n) against the nearest neighbors instead of an O(n) scan of
+   every live range. Children are pool indices; -1 means none. */
 typedef struct range_t {
-    char *lo;              /* low payload address */
+    char *lo;              /* low payload address; NULL when slot is free */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    int left;              /* treap left child (pool index) */
+    int right;             /* treap right child (pool index) */
+    unsigned prio;         /* random heap priority keeping the treap flat */
 } range_t;
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, MEMALIGN} type; /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
+    int align;                        /* requested alignment (MEMALIGN only) */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -69,7 +85,6 @@ typedef struct {
  */
 typedef struct {
     trace_t *trace;
-    range_t *ranges;
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -82,6 +97,11 @@ typedef struct {
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
 
+    /* defined only for a parallel replay (-j N with N > 1) */
+    double worker_secs[MAXWORKERS];  /* per-thread replay time */
+    double worker_stall[MAXWORKERS]; /* per-thread ring wait time (-x) */
+    int worker_ops[MAXWORKERS];      /* ops replayed by each thread */
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -95,6 +115,53 @@ char msg[MAXLINE];      /* for whenever we need to compose an error message */
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
+/* Parallel replay state (set by -j).  A trace's ops are partitioned
+   across the workers by block id, so every free and realloc runs on
+   the thread that did the matching malloc.  When mm.c is not built
+   thread-safe the workers serialize on an external lock, which is the
+   baseline the arena work is measured against. */
+static int nworkers = 1;                /* replay threads (-j) */
+static double worker_secs[MAXWORKERS];  /* per-thread time, last replay */
+static double worker_stall[MAXWORKERS]; /* per-thread ring wait time */
+static int worker_ops[MAXWORKERS];      /* per-thread op counts */
+
+/* Cross-thread replay (-x): the first half of the workers are
+   producers that run the alloc and realloc ops, handing each freed
+   pointer to a partner consumer in the second half through a bounded
+   single-producer single-consumer ring; the consumer calls mm_free.
+   Time spent waiting on a full or empty ring is reported as stall. */
+#define RINGCAP 1024 /* ring entries per producer-consumer pair */
+typedef struct {
+    char *slot[RINGCAP];
+    volatile unsigned head; /* next slot to fill (producer) */
+    volatile unsigned tail; /* next slot to drain (consumer) */
+    volatile int done;      /* producer finished the trace */
+} ring_t;
+static ring_t rings[MAXWORKERS / 2];
+static int crossfree = 0;               /* cross-thread replay (-x) */
+static int alignmode = 0;               /* replay allocs as memaligns (-a) */
+static int latmode = 0;                 /* per-op latency histograms (-L) */
+static int snapop = -1;                 /* op to snapshot after (-S) */
+static int resume = 0;                  /* start replay from a snapshot (-R) */
+static char snapfile[MAXLINE] = "mdriver.snap"; /* snapshot file name */
+static char *snaplive = NULL;           /* per-id liveness from a snapshot */
+static int resumeop = 0;                /* first op a resumed replay runs */
+static double resume_secs;              /* replay time of the last -R run */
+#ifndef MM_THREADSAFE
+static pthread_mutex_t extlock = PTHREAD_MUTEX_INITIALIZER;
+#define REPLAY_LOCK()   pthread_mutex_lock(&extlock)
+#define REPLAY_UNLOCK() pthread_mutex_unlock(&extlock)
+#else
+#define REPLAY_LOCK()   ((void)0)
+#define REPLAY_UNLOCK() ((void)0)
+#endif
+
+/* Argument block for one replay worker */
+typedef struct {
+    trace_t *trace;
+    int rank;
+} worker_t;
+
 /* The filenames of the default tracefiles */
 static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
@@ -105,14 +172,14 @@ static char *default_tracefiles[] = {
  * Function prototypes
  *********************/
 
-/* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size,
-		     int tracenum, int opnum);
-static void remove_range(range_t **ranges, char *lo);
-static void clear_ranges(range_t **ranges);
+/* these functions manipulate the range pool */
+static int add_range(int id, char *lo, int size, int tracenum, int opnum);
+static void remove_range(int id);
+static void clear_ranges(int num_ids);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static void align_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -121,9 +188,14 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, int tracenum);
+
+/* These functions write and load heap snapshots (-S and -R) */
+static void write_snapshot(trace_t *trace, int opnum);
+static int restore_snapshot(trace_t *trace);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -137,12 +209,11 @@ static void app_error(char *msg);
  **************/
 int main(int argc, char **argv)
 {
-    int i;
+    int i, j;
     char c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */
@@ -158,11 +229,23 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:j:xhvVgalLS:R:")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
 	    break;
+	case 'j': /* Replay traces across N threads in the speed runs */
+	    nworkers = atoi(optarg);
+	    if (nworkers < 1 || nworkers > MAXWORKERS) {
+		printf("-j takes a thread count between 1 and %d\n",
+		       MAXWORKERS);
+		exit(1);
+	    }
+	    break;
+	case 'x': /* Producer-consumer replay: allocs and frees on
+		     different threads, handed over bounded rings */
+	    crossfree = 1;
+	    break;
         case 'f': /* Use one specific trace file only (relative to curr dir) */
             num_tracefiles = 1;
             if ((tracefiles = realloc(tracefiles, 2*sizeof(char *))) == NULL)
@@ -178,12 +261,22 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/')
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
-        //case 'a': /* Don't check team structure */
-            //team_check = 0;
-           // break;
+        case 'a': /* Replay allocs as aligned requests */
+            alignmode = 1;
+            break;
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+	case 'L': /* Per-operation latency histograms and outliers */
+	    latmode = 1;
+	    break;
+	case 'S': /* Snapshot the heap after op N of the correctness pass */
+	    snapop = atoi(optarg);
+	    break;
+	case 'R': /* Resume replay from a snapshot file */
+	    resume = 1;
+	    strcpy(snapfile, optarg);
+	    break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -199,6 +292,22 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Cross-thread replay needs a producer and a consumer per pair */
+    if (crossfree) {
+	if (nworkers < 2)
+	    nworkers = 2;
+	if (nworkers % 2) {
+	    printf("-x needs an even -j thread count\n");
+	    exit(1);
+	}
+    }
+
+    /* A snapshot captures one thread's view of the heap */
+    if (resume && nworkers > 1) {
+	printf("-R replays are single-threaded (drop -j/-x)\n");
+	exit(1);
+    }
+
     /*
      * Check and print team info
      */
@@ -236,8 +345,13 @@ int main(int argc, char **argv)
 	printf("Using default tracefiles in %s\n", tracedir);
     }
 
-    /* Initialize the timing package */
+    /* Initialize the timing package. Timer-interrupt compensation in
+       fcyc counts process user-time ticks, which accumulate across
+       threads and over-subtract in threaded replays, so turn it off
+       when the speed runs use more than one worker. */
     init_fsecs();
+    if (nworkers > 1)
+	set_fcyc_compensate(0);
 
     /*
      * Optionally run and evaluate the libc malloc package
@@ -254,6 +368,8 @@ int main(int argc, char **argv)
 	/* Evaluate the libc malloc package using the K-best scheme */
 	for (i=0; i < num_tracefiles; i++) {
 	    trace = read_trace(tracedir, tracefiles[i]);
+	    if (alignmode)
+		align_trace(trace);
 	    libc_stats[i].ops = trace->num_ops;
 	    if (verbose > 1)
 		printf("Checking libc malloc for correctness, ");
@@ -291,19 +407,39 @@ int main(int argc, char **argv)
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
 	trace = read_trace(tracedir, tracefiles[i]);
+	if (alignmode)
+	    align_trace(trace);
 	mm_stats[i].ops = trace->num_ops;
 	if (verbose > 1)
 	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	mm_stats[i].valid = eval_mm_valid(trace, i);
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].util = eval_mm_util(trace, i);
 	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (resume) {
+		/* a resumed replay runs num_ops - resumeop ops and
+		   times itself around the replay loop (fsecs would
+		   fold the snapshot restore into every sample);
+		   keep the best of a few runs, K-best style */
+		mm_stats[i].ops = trace->num_ops - resumeop;
+		for (j = 0; j < 3; j++) {
+		    eval_mm_speed(&speed_params);
+		    if (j == 0 || resume_secs < mm_stats[i].secs)
+			mm_stats[i].secs = resume_secs;
+		}
+	    } else {
+		mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    }
+	    if (latmode)
+		eval_mm_latency(trace, i);
+	    memcpy(mm_stats[i].worker_secs, worker_secs, sizeof(worker_secs));
+	    memcpy(mm_stats[i].worker_stall, worker_stall,
+		   sizeof(worker_stall));
+	    memcpy(mm_stats[i].worker_ops, worker_ops, sizeof(worker_ops));
 	}
 	free_trace(trace);
     }
@@ -368,22 +504,110 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
- * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * The following routines manipulate the range pool, which keeps
+ * track of the extent of every allocated block payload. We use it
+ * to detect any overlapping allocated blocks. Slots are addressed
+ * by block id, and live slots form a treap ordered by payload
+ * address (see range_t above), so validating a million-op capture
+ * no longer spends longer in the driver than in the allocator.
  ****************************************************************/
 
+static range_t *rangepool = NULL;  /* one slot per block id */
+static int rangecap = 0;           /* slots allocated in the pool */
+static int rangeroot = -1;         /* treap root (pool index) */
+
+/*
+ * range_prio - Random treap priorities (xorshift). The trace replays
+ *     blocks in roughly increasing address order, which would turn a
+ *     plain address-keyed BST into a linked list.
+ */
+static unsigned range_prio(void)
+{
+    static unsigned seed = 2463534242u;
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/*
+ * range_rotate - Rotate the subtree at t so its left (dir == 0) or
+ *     right (dir == 1) child becomes the root; returns the new root.
+ */
+static int range_rotate(int t, int dir)
+{
+    int c;
+
+    if (dir == 0) {
+	c = rangepool[t].left;
+	rangepool[t].left = rangepool[c].right;
+	rangepool[c].right = t;
+    } else {
+	c = rangepool[t].right;
+	rangepool[t].right = rangepool[c].left;
+	rangepool[c].left = t;
+    }
+    return c;
+}
+
+/*
+ * range_insert - Insert pool slot n into the subtree at t, keeping
+ *     address order and the priority heap; returns the new root.
+ */
+static int range_insert(int t, int n)
+{
+    if (t == -1)
+	return n;
+    if (rangepool[n].lo < rangepool[t].lo) {
+	rangepool[t].left = range_insert(rangepool[t].left, n);
+	if (rangepool[rangepool[t].left].prio > rangepool[t].prio)
+	    t = range_rotate(t, 0);
+    } else {
+	rangepool[t].right = range_insert(rangepool[t].right, n);
+	if (rangepool[rangepool[t].right].prio > rangepool[t].prio)
+	    t = range_rotate(t, 1);
+    }
+    return t;
+}
+
+/*
+ * range_delete - Remove the slot with payload address lo from the
+ *     subtree at t by rotating it down to a leaf; returns the new root.
+ */
+static int range_delete(int t, char *lo)
+{
+    if (t == -1)
+	return -1;
+    if (lo < rangepool[t].lo) {
+	rangepool[t].left = range_delete(rangepool[t].left, lo);
+    } else if (lo > rangepool[t].lo) {
+	rangepool[t].right = range_delete(rangepool[t].right, lo);
+    } else if (rangepool[t].left == -1) {
+	return rangepool[t].right;
+    } else if (rangepool[t].right == -1) {
+	return rangepool[t].left;
+    } else if (rangepool[rangepool[t].left].prio >
+	       rangepool[rangepool[t].right].prio) {
+	t = range_rotate(t, 0);
+	rangepool[t].right = range_delete(rangepool[t].right, lo);
+    } else {
+	t = range_rotate(t, 1);
+	rangepool[t].left = range_delete(rangepool[t].left, lo);
+    }
+    return t;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
- *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     size bytes at addr lo for block id. After checking the block for
+ *     correctness we record its extent in the pool slot for that id.
  */
-static int add_range(range_t **ranges, char *lo, int size,
-		     int tracenum, int opnum)
+static int add_range(int id, char *lo, int size, int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    int t, pred, succ;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -396,72 +620,165 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or inside
+       a chunk the allocator obtained through mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* The payload must not overlap any other payloads. Live ranges
+       are disjoint, so it is enough to check the nearest neighbor on
+       each side of lo in address order. */
+    pred = succ = -1;
+    for (t = rangeroot; t != -1; ) {
+	if (lo < rangepool[t].lo) {
+	    succ = t;
+	    t = rangepool[t].left;
+	} else {
+	    pred = t;
+	    t = rangepool[t].right;
+	}
+    }
+    if ((pred != -1 && rangepool[pred].hi >= lo) ||
+	(succ != -1 && rangepool[succ].lo <= hi)) {
+	t = (pred != -1 && rangepool[pred].hi >= lo) ? pred : succ;
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, rangepool[t].lo, rangepool[t].hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /*
-     * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
+     * Everything looks OK, so remember the extent of this block in
+     * the slot for its id and link it into the treap.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
-    p->lo = lo;
-    p->hi = hi;
-    *ranges = p;
+    rangepool[id].lo = lo;
+    rangepool[id].hi = hi;
+    rangepool[id].left = -1;
+    rangepool[id].right = -1;
+    rangepool[id].prio = range_prio();
+    rangeroot = range_insert(rangeroot, id);
     return 1;
 }
 
 /*
- * remove_range - Free the range record of block whose payload starts at lo
+ * remove_range - Free the range record of block id
  */
-static void remove_range(range_t **ranges, char *lo)
+static void remove_range(int id)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    int size;
+    if (rangepool[id].lo == NULL)
+	return;
+    rangeroot = range_delete(rangeroot, rangepool[id].lo);
+    rangepool[id].lo = NULL;
+}
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+/*
+ * clear_ranges - reset the pool for a trace with num_ids block ids
+ */
+static void clear_ranges(int num_ids)
+{
+    int i;
+
+    if (num_ids > rangecap) {
+	rangepool = (range_t *)realloc(rangepool, num_ids * sizeof(range_t));
+	if (rangepool == NULL)
+	    unix_error("realloc error in clear_ranges");
+	rangecap = num_ids;
     }
+    for (i = 0; i < num_ids; i++)
+	rangepool[i].lo = NULL;
+    rangeroot = -1;
 }
 
+
+/*****************************************************************
+ * The following routines snapshot and restore the replay state,
+ * so an experiment can start from a fragmented mid-trace heap in
+ * seconds instead of replaying the ops that built it (-S / -R).
+ * A snapshot holds the driver's block table and liveness, the
+ * allocator's root state (mm_state_save) and the heap image
+ * itself (mem_save); it is only valid for the same trace and the
+ * same build configuration.
+ ****************************************************************/
+
+#define SNAP_MAGIC 0x6d64736e  /* "mdsn" */
+
 /*
- * clear_ranges - free all of the range records for a trace
+ * write_snapshot - capture the replay state right after op opnum of
+ *    the correctness pass to the snapshot file
  */
-static void clear_ranges(range_t **ranges)
+static void write_snapshot(trace_t *trace, int opnum)
 {
-    range_t *p;
-    range_t *pnext;
+    FILE *fp;
+    unsigned int magic = SNAP_MAGIC;
+    char live;
+    int i;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    if ((fp = fopen(snapfile, "w")) == NULL)
+	unix_error("could not create snapshot file");
+    if (fwrite(&magic, sizeof(magic), 1, fp) != 1 ||
+	fwrite(&opnum, sizeof(opnum), 1, fp) != 1 ||
+	fwrite(&trace->num_ids, sizeof(int), 1, fp) != 1 ||
+	fwrite(&trace->num_ops, sizeof(int), 1, fp) != 1 ||
+	fwrite(trace->blocks, sizeof(char *), trace->num_ids, fp)
+	    != (size_t)trace->num_ids ||
+	fwrite(trace->block_sizes, sizeof(size_t), trace->num_ids, fp)
+	    != (size_t)trace->num_ids)
+	app_error("write error in write_snapshot");
+    for (i = 0; i < trace->num_ids; i++) {
+	live = (rangepool[i].lo != NULL);
+	if (fwrite(&live, 1, 1, fp) != 1)
+	    app_error("write error in write_snapshot");
     }
-    *ranges = NULL;
+    if (mm_state_save(fp) < 0)
+	app_error("mm_state_save failed in write_snapshot");
+    if (mem_save(fp) < 0)
+	app_error("mem_save failed in write_snapshot");
+    fclose(fp);
+    if (verbose)
+	printf("Wrote snapshot after op %d to %s\n", opnum, snapfile);
+}
+
+/*
+ * restore_snapshot - load the snapshot file into the current replay
+ *    state; returns the index of the first op left to replay
+ */
+static int restore_snapshot(trace_t *trace)
+{
+    FILE *fp;
+    unsigned int magic;
+    int opnum, num_ids, num_ops;
+
+    if ((fp = fopen(snapfile, "r")) == NULL)
+	unix_error("could not open snapshot file");
+    if (fread(&magic, sizeof(magic), 1, fp) != 1 || magic != SNAP_MAGIC ||
+	fread(&opnum, sizeof(opnum), 1, fp) != 1 ||
+	fread(&num_ids, sizeof(int), 1, fp) != 1 ||
+	fread(&num_ops, sizeof(int), 1, fp) != 1)
+	app_error("bad snapshot file");
+    if (num_ids != trace->num_ids || num_ops != trace->num_ops)
+	app_error("snapshot does not match this trace (use -f with the "
+		  "trace it was taken from)");
+    if ((snaplive = (char *)realloc(snaplive, num_ids)) == NULL)
+	unix_error("realloc error in restore_snapshot");
+    if (fread(trace->blocks, sizeof(char *), num_ids, fp)
+	    != (size_t)num_ids ||
+	fread(trace->block_sizes, sizeof(size_t), num_ids, fp)
+	    != (size_t)num_ids ||
+	fread(snaplive, 1, num_ids, fp) != (size_t)num_ids)
+	app_error("bad snapshot file");
+    if (mm_state_restore(fp) < 0)
+	app_error("snapshot was taken by a differently configured build");
+    if (mem_restore(fp) < 0)
+	app_error("could not restore the heap image");
+    fclose(fp);
+    resumeop = opnum + 1;
+    return resumeop;
 }
 
 
@@ -469,6 +786,103 @@ static void clear_ranges(range_t **ranges)
  * The following routines manipulate tracefiles
  *********************************************/
 
+/*
+ * A .repbin sidecar caches the decoded form of a trace file: a five
+ * word header (magic, suggested heap size, num_ids, num_ops, weight)
+ * followed by one packed record per request - the op type in the top
+ * two bits and the block id below it, then the request size.  Reading
+ * it back is a single mmap and a tight decode loop, so repeated driver
+ * runs skip the fscanf parse entirely.
+ */
+#define REPBIN_MAGIC 0x6e627053  /* "Spbn": bumped for the align word */
+#define REPBIN_HDR   5           /* header words before the records */
+
+/*
+ * read_repbin - fill in trace from a .repbin sidecar
+ * Returns 0 on success, -1 if the sidecar is missing, stale, or bogus.
+ */
+static int read_repbin(char *path, char *binpath, trace_t *trace)
+{
+    struct stat st, bst;
+    unsigned *words, packed;
+    int fd, i;
+
+    /* use the sidecar only if it is newer than the trace itself */
+    if (stat(path, &st) < 0 || stat(binpath, &bst) < 0 ||
+	bst.st_mtime < st.st_mtime)
+	return -1;
+
+    if ((fd = open(binpath, O_RDONLY)) < 0)
+	return -1;
+    words = (unsigned *)mmap(NULL, bst.st_size, PROT_READ, MAP_PRIVATE,
+			     fd, 0);
+    close(fd);
+    if (words == (unsigned *)MAP_FAILED)
+	return -1;
+
+    if (bst.st_size < (long)(REPBIN_HDR * sizeof(unsigned)) ||
+	words[0] != REPBIN_MAGIC ||
+	bst.st_size != (long)((REPBIN_HDR + 3 * (size_t)words[3])
+			      * sizeof(unsigned))) {
+	munmap(words, bst.st_size);
+	return -1;
+    }
+    trace->sugg_heapsize = words[1];
+    trace->num_ids = words[2];
+    trace->num_ops = words[3];
+    trace->weight = words[4];
+
+    if ((trace->ops =
+	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+	unix_error("malloc 2 failed in read_trace");
+
+    for (i = 0; i < trace->num_ops; i++) {
+	packed = words[REPBIN_HDR + 3 * i];
+	trace->ops[i].type = packed >> 30;
+	trace->ops[i].index = packed & 0x3fffffff;
+	trace->ops[i].size = words[REPBIN_HDR + 3 * i + 1];
+	trace->ops[i].align = words[REPBIN_HDR + 3 * i + 2];
+    }
+    munmap(words, bst.st_size);
+    return 0;
+}
+
+/*
+ * write_repbin - write the decoded trace out as a .repbin sidecar.
+ * Best effort: a read-only trace directory just skips the cache.
+ */
+static void write_repbin(char *binpath, trace_t *trace)
+{
+    FILE *binfile;
+    unsigned word;
+    int i;
+
+    if ((binfile = fopen(binpath, "w")) == NULL)
+	return;
+
+    word = REPBIN_MAGIC;
+    fwrite(&word, sizeof(word), 1, binfile);
+    word = trace->sugg_heapsize;
+    fwrite(&word, sizeof(word), 1, binfile);
+    word = trace->num_ids;
+    fwrite(&word, sizeof(word), 1, binfile);
+    word = trace->num_ops;
+    fwrite(&word, sizeof(word), 1, binfile);
+    word = trace->weight;
+    fwrite(&word, sizeof(word), 1, binfile);
+
+    for (i = 0; i < trace->num_ops; i++) {
+	word = ((unsigned)trace->ops[i].type << 30)
+	     | (unsigned)trace->ops[i].index;
+	fwrite(&word, sizeof(word), 1, binfile);
+	word = trace->ops[i].size;
+	fwrite(&word, sizeof(word), 1, binfile);
+	word = trace->ops[i].align;
+	fwrite(&word, sizeof(word), 1, binfile);
+    }
+    fclose(binfile);
+}
+
 /*
  * read_trace - read a trace file and store it in memory
  */
@@ -478,7 +892,8 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    char binpath[MAXLINE + 8];
+    unsigned index, size, align;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -489,9 +904,21 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
 
-    /* Read the trace file header */
+    /* Prefer the pre-decoded sidecar over parsing the text */
     strcpy(path, tracedir);
     strcat(path, filename);
+    sprintf(binpath, "%s.repbin", path);
+    if (read_repbin(path, binpath, trace) == 0) {
+	if ((trace->blocks =
+	     (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	    unix_error("malloc 3 failed in read_trace");
+	if ((trace->block_sizes =
+	     (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	    unix_error("malloc 4 failed in read_trace");
+	return trace;
+    }
+
+    /* Read the trace file header */
     if ((tracefile = fopen(path, "r")) == NULL) {
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
@@ -526,6 +953,15 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].type = ALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = 0;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'm': /* extended op: aligned allocation "m <id> <align> <size>" */
+	    fscanf(tracefile, "%u %u %u", &index, &align, &size);
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = align;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'r':
@@ -533,12 +969,15 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].type = REALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = 0;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = 0;
+	    trace->ops[op_index].align = 0;
 	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n",
@@ -552,6 +991,9 @@ static trace_t *read_trace(char *tracedir, char *filename)
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
 
+    /* cache the decoded form for the next run */
+    write_repbin(binpath, trace);
+
     return trace;
 }
 
@@ -567,6 +1009,24 @@ void free_trace(trace_t *trace)
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * align_trace - rewrite a trace's allocs as aligned requests (-a):
+ * every ALLOC becomes a MEMALIGN on a 16/32/64-byte boundary picked by
+ * block id, so the standard traces measure aligned-workload
+ * utilization and throughput without needing dedicated trace files.
+ */
+static void align_trace(trace_t *trace)
+{
+    int i;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	if (trace->ops[i].type == ALLOC) {
+	    trace->ops[i].type = MEMALIGN;
+	    trace->ops[i].align = 16 << (trace->ops[i].index % 3);
+	}
+    }
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -575,7 +1035,7 @@ void free_trace(trace_t *trace)
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
+static int eval_mm_valid(trace_t *trace, int tracenum)
 {
     int i, j;
     int index;
@@ -585,18 +1045,32 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *oldp;
     char *p;
 
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and the range records */
     mem_reset_brk();
-    clear_ranges(ranges);
-
-    /* Call the mm package's init function */
-    if (mm_init() < 0) {
-	malloc_error(tracenum, 0, "mm_init failed.");
-	return 0;
+    clear_ranges(trace->num_ids);
+
+    if (resume) {
+	/* Start from the snapshot instead of an empty heap, and
+	   rebuild the range records for the restored live blocks;
+	   add_range re-checks their alignment and overlap for free */
+	i = restore_snapshot(trace);
+	for (index = 0; index < trace->num_ids; index++) {
+	    if (snaplive[index] &&
+		add_range(index, trace->blocks[index],
+			  trace->block_sizes[index], tracenum, i - 1) == 0)
+		return 0;
+	}
+    } else {
+	/* Call the mm package's init function */
+	if (mm_init() < 0) {
+	    malloc_error(tracenum, 0, "mm_init failed.");
+	    return 0;
+	}
+	i = 0;
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
+    for (;  i < trace->num_ops;  i++) {
 	index = trace->ops[i].index;
 	size = trace->ops[i].size;
 
@@ -612,10 +1086,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
 	    /*
 	     * Test the range of the new block for correctness and add it
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range pool if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block.
 	     */
-	    if (add_range(ranges, p, size, tracenum, i) == 0)
+	    if (add_range(index, p, size, tracenum, i) == 0)
 		return 0;
 
 	    /* ADDED: cgw
@@ -630,6 +1104,25 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->block_sizes[index] = size;
 	    break;
 
+        case MEMALIGN: /* mm_memalign */
+
+	    /* Call the student's memalign and verify the boundary */
+	    if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_memalign failed.");
+		return 0;
+	    }
+	    if (((size_t)p % trace->ops[i].align) != 0) {
+		malloc_error(tracenum, i, "mm_memalign block misaligned.");
+		return 0;
+	    }
+
+	    if (add_range(index, p, size, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
         case REALLOC: /* mm_realloc */
 
 	    /* Call the student's realloc */
@@ -639,11 +1132,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 		return 0;
 	    }
 
-	    /* Remove the old region from the range list */
-	    remove_range(ranges, oldp);
+	    /* Remove the old region from the range pool */
+	    remove_range(index);
 
-	    /* Check new block for correctness and add it to range list */
-	    if (add_range(ranges, newp, size, tracenum, i) == 0)
+	    /* Check new block for correctness and add it to range pool */
+	    if (add_range(index, newp, size, tracenum, i) == 0)
 		return 0;
 
 	    /* ADDED: cgw
@@ -669,9 +1162,9 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
         case FREE: /* mm_free */
 
-	    /* Remove region from list and call student's free function */
+	    /* Remove region from pool and call student's free function */
 	    p = trace->blocks[index];
-	    remove_range(ranges, p);
+	    remove_range(index);
 	    mm_free(p);
 	    break;
 
@@ -679,6 +1172,8 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	if (i == snapop)
+	    write_snapshot(trace, i);
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -690,28 +1185,39 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   high water mark of the heap over the whole trace. Since mem_sbrk()
+ *   allows the malloc package to trim the heap, the heap size is
+ *   sampled after every operation rather than once at the end.
  *
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum)
 {
     int i;
     int index;
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    size_t max_heapsize = 0;
     char *p;
     char *newp, *oldp;
 
     /* initialize the heap and the mm malloc package */
-    mem_reset_brk();
-    if (mm_init() < 0)
-	app_error("mm_init failed in eval_mm_util");
+    if (resume) {
+	/* pick up mid-trace; the blocks restored live seed the total */
+	i = restore_snapshot(trace);
+	for (index = 0; index < trace->num_ids; index++) {
+	    if (snaplive[index])
+		total_size += trace->block_sizes[index];
+	}
+	max_total_size = total_size;
+    } else {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_util");
+	i = 0;
+    }
 
-    for (i = 0;  i < trace->num_ops;  i++) {
+    for (;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
@@ -734,6 +1240,20 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 		total_size : max_total_size;
 	    break;
 
+	case MEMALIGN: /* mm_memalign */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+
+	    if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+		app_error("mm_memalign failed in eval_mm_util");
+
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -773,29 +1293,261 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	/* Track the high water mark of the heap, counting any chunks
+	   the allocator holds outside the sbrk heap via mem_map */
+	if (mem_heapsize() + mem_mapsize() > max_heapsize)
+	    max_heapsize = mem_heapsize() + mem_mapsize();
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)max_heapsize);
 }
 
 
+/*
+ * speed_worker - replay one thread's share of a trace: every op whose
+ *    block id hashes to this worker's rank, in trace order.
+ */
+static void *speed_worker(void *ptr)
+{
+    worker_t *w = (worker_t *)ptr;
+    trace_t *trace = w->trace;
+    struct timespec start, end;
+    int i, index, size, newsize, nops = 0;
+    char *p, *newp, *oldp, *block;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	if (index % nworkers != w->rank)
+	    continue;
+	nops++;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            size = trace->ops[i].size;
+	    REPLAY_LOCK();
+	    p = mm_malloc(size);
+	    REPLAY_UNLOCK();
+            if (p == NULL)
+		app_error("mm_malloc error in speed_worker");
+            trace->blocks[index] = p;
+            break;
+
+	case MEMALIGN: /* mm_memalign */
+            size = trace->ops[i].size;
+	    REPLAY_LOCK();
+	    p = mm_memalign(trace->ops[i].align, size);
+	    REPLAY_UNLOCK();
+            if (p == NULL)
+		app_error("mm_memalign error in speed_worker");
+            trace->blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            newsize = trace->ops[i].size;
+	    oldp = trace->blocks[index];
+	    REPLAY_LOCK();
+	    newp = mm_realloc(oldp, newsize);
+	    REPLAY_UNLOCK();
+            if (newp == NULL)
+		app_error("mm_realloc error in speed_worker");
+            trace->blocks[index] = newp;
+            break;
+
+        case FREE: /* mm_free */
+            block = trace->blocks[index];
+	    REPLAY_LOCK();
+            mm_free(block);
+	    REPLAY_UNLOCK();
+            break;
+
+	default:
+	    app_error("Nonexistent request type in speed_worker");
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    worker_ops[w->rank] = nops;
+    worker_secs[w->rank] = (end.tv_sec - start.tv_sec)
+	+ (end.tv_nsec - start.tv_nsec) * 1e-9;
+    return NULL;
+}
+
+/*
+ * speed_producer - cross-thread replay: run this worker's alloc and
+ *    realloc ops and push each freed pointer to the partner consumer.
+ */
+static void *speed_producer(void *ptr)
+{
+    worker_t *w = (worker_t *)ptr;
+    trace_t *trace = w->trace;
+    ring_t *ring = &rings[w->rank];
+    int npairs = nworkers / 2;
+    struct timespec start, end, w0, w1;
+    int i, index, size, newsize, nops = 0;
+    double stall = 0;
+    char *p, *newp, *oldp;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	if (index % npairs != w->rank)
+	    continue;
+	nops++;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            size = trace->ops[i].size;
+	    REPLAY_LOCK();
+	    p = mm_malloc(size);
+	    REPLAY_UNLOCK();
+            if (p == NULL)
+		app_error("mm_malloc error in speed_producer");
+            trace->blocks[index] = p;
+            break;
+
+	case MEMALIGN: /* mm_memalign */
+            size = trace->ops[i].size;
+	    REPLAY_LOCK();
+	    p = mm_memalign(trace->ops[i].align, size);
+	    REPLAY_UNLOCK();
+            if (p == NULL)
+		app_error("mm_memalign error in speed_producer");
+            trace->blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            newsize = trace->ops[i].size;
+	    oldp = trace->blocks[index];
+	    REPLAY_LOCK();
+	    newp = mm_realloc(oldp, newsize);
+	    REPLAY_UNLOCK();
+            if (newp == NULL)
+		app_error("mm_realloc error in speed_producer");
+            trace->blocks[index] = newp;
+            break;
+
+        case FREE: /* hand the pointer off; spin while the ring is full */
+	    if (ring->head - ring->tail == RINGCAP) {
+		clock_gettime(CLOCK_MONOTONIC, &w0);
+		while (ring->head - ring->tail == RINGCAP)
+		    ;
+		clock_gettime(CLOCK_MONOTONIC, &w1);
+		stall += (w1.tv_sec - w0.tv_sec)
+		    + (w1.tv_nsec - w0.tv_nsec) * 1e-9;
+	    }
+	    ring->slot[ring->head % RINGCAP] = trace->blocks[index];
+	    __sync_synchronize();
+	    ring->head++;
+            break;
+
+	default:
+	    app_error("Nonexistent request type in speed_producer");
+        }
+    }
+    __sync_synchronize();
+    ring->done = 1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    worker_ops[w->rank] = nops;
+    worker_secs[w->rank] = (end.tv_sec - start.tv_sec)
+	+ (end.tv_nsec - start.tv_nsec) * 1e-9;
+    worker_stall[w->rank] = stall;
+    return NULL;
+}
+
+/*
+ * speed_consumer - cross-thread replay: free every pointer the partner
+ *    producer pushes, until the producer finishes and the ring drains.
+ */
+static void *speed_consumer(void *ptr)
+{
+    worker_t *w = (worker_t *)ptr;
+    ring_t *ring = &rings[w->rank - nworkers / 2];
+    struct timespec start, end, w0, w1;
+    int nops = 0;
+    double stall = 0;
+    char *block;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+	if (ring->tail == ring->head) {
+	    if (ring->done && ring->tail == ring->head)
+		break;
+	    clock_gettime(CLOCK_MONOTONIC, &w0);
+	    while (ring->tail == ring->head && !ring->done)
+		;
+	    clock_gettime(CLOCK_MONOTONIC, &w1);
+	    stall += (w1.tv_sec - w0.tv_sec)
+		+ (w1.tv_nsec - w0.tv_nsec) * 1e-9;
+	    continue;
+	}
+	__sync_synchronize();
+	block = ring->slot[ring->tail % RINGCAP];
+	REPLAY_LOCK();
+	mm_free(block);
+	REPLAY_UNLOCK();
+	ring->tail++;
+	nops++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    worker_ops[w->rank] = nops;
+    worker_secs[w->rank] = (end.tv_sec - start.tv_sec)
+	+ (end.tv_nsec - start.tv_nsec) * 1e-9;
+    worker_stall[w->rank] = stall;
+    return NULL;
+}
+
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
  *    to measure the running time of the mm malloc package.
+ *    With -j N it times N workers replaying the trace in parallel.
  */
 static void eval_mm_speed(void *ptr)
 {
     int i, index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    pthread_t tids[MAXWORKERS];
+    worker_t workers[MAXWORKERS];
+    struct timespec start, end;
+
+    /* Reset the heap and initialize the mm package, or warm-start
+       from the snapshot (restored again on every timing run, so each
+       sample replays from the same state). The restore is file I/O
+       and a heap remap, so only the replay loop below is timed */
+    if (resume) {
+	i = restore_snapshot(trace);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+    } else {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_speed");
+	i = 0;
+    }
 
-    /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (mm_init() < 0)
-	app_error("mm_init failed in eval_mm_speed");
+    if (nworkers > 1) {
+	if (crossfree)
+	    memset(rings, 0, (nworkers / 2) * sizeof(ring_t));
+	for (i = 0; i < nworkers; i++) {
+	    workers[i].trace = trace;
+	    workers[i].rank = i;
+	    if (pthread_create(&tids[i], NULL,
+			       !crossfree ? speed_worker :
+			       (i < nworkers / 2 ? speed_producer
+						 : speed_consumer),
+			       &workers[i]))
+		unix_error("pthread_create failed in eval_mm_speed");
+	}
+	for (i = 0; i < nworkers; i++)
+	    pthread_join(tids[i], NULL);
+	return;
+    }
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
+    for (;  i < trace->num_ops;  i++)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
@@ -806,6 +1558,14 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+	case MEMALIGN: /* mm_memalign */
+	    index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+		app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -824,6 +1584,161 @@ static void eval_mm_speed(void *ptr)
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
+
+    if (resume) {
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	resume_secs = (end.tv_sec - start.tv_sec)
+	    + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    }
+}
+
+/* Number of log2 buckets in the latency histogram: bucket b counts
+   ops that took [2^b, 2^(b+1)) cycles, which covers any realistic op */
+#define LATBUCKETS 40
+
+/* How many of the slowest ops to report individually */
+#define LATWORST 3
+
+/* qsort comparator for the cycle samples */
+static int latcmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * eval_mm_latency - Replay a trace once more, timestamping every
+ *    operation with the cycle counter from clock.c, and report a
+ *    log-scale latency histogram with p50/p99/p99.9 and the op
+ *    numbers of the worst outliers (-L). The aggregate Kops figure
+ *    from fsecs averages away the occasional pathological call (a
+ *    malloc that walks a huge free list); this shows which trace
+ *    positions trigger them. The replay is always single-threaded
+ *    so a sample measures one call, not scheduler noise.
+ */
+static void eval_mm_latency(trace_t *trace, int tracenum)
+{
+    int i, i0, j, k, index, size, newsize, nops = trace->num_ops;
+    char *p, *newp, *oldp, *block;
+    double *lat, *sorted;
+    long hist[LATBUCKETS];
+    int worst[LATWORST];
+    static const char opchar[] = {'a', 'f', 'r', 'm'}; /* traceop order */
+
+    if ((lat = (double *)malloc(2 * nops * sizeof(double))) == NULL)
+	unix_error("malloc failed in eval_mm_latency");
+    sorted = lat + nops;
+
+    /* Reset the heap and initialize the mm package, or warm-start
+       from the snapshot */
+    if (resume) {
+	i0 = restore_snapshot(trace);
+    } else {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_latency");
+	i0 = 0;
+    }
+    nops -= i0;
+
+    /* Interpret each trace request, timing it in isolation */
+    for (i = i0;  i < trace->num_ops;  i++) {
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+	    start_counter();
+            p = mm_malloc(size);
+	    lat[i - i0] = get_counter();
+	    if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+	case MEMALIGN: /* mm_memalign */
+	    index = trace->ops[i].index;
+            size = trace->ops[i].size;
+	    start_counter();
+            p = mm_memalign(trace->ops[i].align, size);
+	    lat[i - i0] = get_counter();
+	    if (p == NULL)
+		app_error("mm_memalign error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+	    index = trace->ops[i].index;
+            newsize = trace->ops[i].size;
+	    oldp = trace->blocks[index];
+	    start_counter();
+            newp = mm_realloc(oldp, newsize);
+	    lat[i - i0] = get_counter();
+	    if (newp == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = newp;
+            break;
+
+        case FREE: /* mm_free */
+            index = trace->ops[i].index;
+            block = trace->blocks[index];
+	    start_counter();
+            mm_free(block);
+	    lat[i - i0] = get_counter();
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+        }
+	if (lat[i - i0] < 0)
+	    lat[i - i0] = 0; /* counter wrapped or migrated; don't skew buckets */
+    }
+
+    /* Bucket each sample by floor(log2(cycles)) */
+    for (j = 0; j < LATBUCKETS; j++)
+	hist[j] = 0;
+    for (i = 0; i < nops; i++) {
+	for (j = 0; j + 1 < LATBUCKETS && lat[i] >= (double)(1LL << (j+1)); j++)
+	    ;
+	hist[j]++;
+    }
+
+    /* Exact percentiles from a sorted copy of the samples */
+    memcpy(sorted, lat, nops * sizeof(double));
+    qsort(sorted, nops, sizeof(double), latcmp);
+
+    printf("\ntrace %d: latency of %d ops (cycles)\n", tracenum, nops);
+    printf("  p50 %.0f, p99 %.0f, p99.9 %.0f, max %.0f\n",
+	   sorted[nops / 2],
+	   sorted[(int)(nops * 0.99) < nops ? (int)(nops * 0.99) : nops - 1],
+	   sorted[(int)(nops * 0.999) < nops ? (int)(nops * 0.999) : nops - 1],
+	   sorted[nops - 1]);
+    for (j = 0; j < LATBUCKETS; j++) {
+	if (hist[j] == 0)
+	    continue;
+	printf("  [%10lld, %10lld): %8ld  ",
+	       1LL << j, 1LL << (j+1), hist[j]);
+	for (k = 0; k < (int)((60 * hist[j] + nops - 1) / nops); k++)
+	    printf("*");
+	printf("\n");
+    }
+
+    /* The worst LATWORST ops, by op number, so the scan that caused
+       each one can be reproduced with the trace in hand; each pick
+       clobbers its sample so the next pass finds the runner-up */
+    for (k = 0; k < LATWORST && k < nops; k++) {
+	worst[k] = 0;
+	for (i = 1; i < nops; i++)
+	    if (lat[i] > lat[worst[k]])
+		worst[k] = i;
+	i = worst[k];
+	printf("  outlier: op %d (%c #%d) took %.0f cycles\n",
+	       i0 + i, opchar[trace->ops[i0 + i].type],
+	       trace->ops[i0 + i].index, lat[i]);
+	lat[i] = -1.0;
+    }
+
+    free(lat);
 }
 
 /*
@@ -848,6 +1763,15 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    trace->blocks[trace->ops[i].index] = p;
 	    break;
 
+	case MEMALIGN: /* posix_memalign */
+	    if (posix_memalign((void **)&p, trace->ops[i].align,
+			       trace->ops[i].size) != 0) {
+		malloc_error(tracenum, i, "libc posix_memalign failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[trace->ops[i].index];
@@ -892,6 +1816,14 @@ static void eval_libc_speed(void *ptr)
 	    trace->blocks[index] = p;
 	    break;
 
+	case MEMALIGN: /* posix_memalign */
+	    index = trace->ops[i].index;
+	    if (posix_memalign((void **)&p, trace->ops[i].align,
+			       trace->ops[i].size) != 0)
+		unix_error("posix_memalign failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -921,7 +1853,7 @@ static void eval_libc_speed(void *ptr)
  */
 static void printresults(int n, stats_t *stats)
 {
-    int i;
+    int i, t;
     double secs = 0;
     double ops = 0;
     double util = 0;
@@ -941,6 +1873,22 @@ static void printresults(int n, stats_t *stats)
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    /* per-thread breakdown of the parallel replay */
+	    if (nworkers > 1 && stats[i].worker_secs[0] > 0) {
+		printf("   ");
+		for (t = 0; t < nworkers; t++)
+		    printf(" t%d:%.0f", t,
+			   (stats[i].worker_ops[t]/1e3)
+			   / stats[i].worker_secs[t]);
+		printf(" Kops\n");
+		if (crossfree) {
+		    printf("   ");
+		    for (t = 0; t < nworkers; t++)
+			printf(" t%d:%.2f", t,
+			       stats[i].worker_stall[t] * 1e3);
+		    printf(" ms ring stall\n");
+		}
+	    }
 	}
 	else {
 	    printf("%2d%10s%6s%8s%10s%6s\n",
@@ -1005,13 +1953,24 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValL] [-f <file>] [-t <dir>] [-j <n>]\n");
+    fprintf(stderr, "               [-S <op>] [-R <file>]\n");
     fprintf(stderr, "Options\n");
-//    fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-a         Replay allocs as mm_memalign requests\n");
+    fprintf(stderr, "\t           (16/32/64-byte boundaries by block id).\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Replay each trace across <n> threads.\n");
+    fprintf(stderr, "\t-x         Cross-thread replay: half the -j threads\n");
+    fprintf(stderr, "\t           malloc, the other half free via rings.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Print a per-op latency histogram with\n");
+    fprintf(stderr, "\t           percentiles and worst outliers per trace.\n");
+    fprintf(stderr, "\t-S <op>    Snapshot the heap after trace op <op>\n");
+    fprintf(stderr, "\t           to mdriver.snap (use with -f).\n");
+    fprintf(stderr, "\t-R <file>  Resume replay from snapshot <file>\n");
+    fprintf(stderr, "\t           instead of an empty heap (use with -f).\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
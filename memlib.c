@@ -17,21 +17,39 @@
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_max_brk;    /* high-water mark of mem_brk */
+static char *mem_max_addr;   /* largest legal heap address */
+static size_t mem_map_size;  /* bytes currently held by mem_map */
+
+/* table of live mem_map regions, so the driver can tell payloads in
+   mapped chunks from stray pointers (see mem_is_mapped) */
+#define MEM_MAXMAPS 8192
+static struct {
+    char *base;
+    size_t len;
+} mem_maps[MEM_MAXMAPS];
+#ifdef MM_THREADSAFE
+static volatile int mem_maplock;
+#endif
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* reserve the storage we will use to model the available VM.
+       mmap (rather than malloc) so that mem_decommit can hand unused
+       pages back to the OS while keeping the range reserved */
+    mem_start_brk = (char *)mmap(NULL, MAX_HEAP, PROT_READ|PROT_WRITE,
+				 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_max_brk = mem_start_brk;
 }
 
 /* 
@@ -39,7 +57,7 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_start_brk, MAX_HEAP);
 }
 
 /*
@@ -48,24 +66,293 @@ void mem_deinit(void)
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    mem_max_brk = mem_start_brk;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    A negative incr trims the heap, as long as it does not drop
+ *    below the initial break.
  */
 void *mem_sbrk(int incr) 
 {
+#ifdef MM_THREADSAFE
+    /* several arenas may extend the heap concurrently: claim the new
+       area with a compare-and-swap on the brk pointer */
+    char *old_brk, *new_brk;
+
+    do {
+	old_brk = mem_brk;
+	new_brk = old_brk + incr;
+	if ((new_brk < mem_start_brk) || (new_brk > mem_max_addr)) {
+	    errno = ENOMEM;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+	    return (void *)-1;
+	}
+    } while (!__sync_bool_compare_and_swap(&mem_brk, old_brk, new_brk));
+    if (new_brk > mem_max_brk)
+	mem_max_brk = new_brk;
+    return (void *)old_brk;
+#else
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ( ((mem_brk + incr) < mem_start_brk) || ((mem_brk + incr) > mem_max_addr)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (mem_brk > mem_max_brk)
+	mem_max_brk = mem_brk;
     return (void *)old_brk;
+#endif
+}
+
+/*
+ * mem_decommit - return the physical pages fully inside [lo, hi) to
+ *    the OS. The address range stays reserved and reads as zero when
+ *    touched again, so this only trades RSS for refault cost.
+ */
+void mem_decommit(void *lo, void *hi)
+{
+    size_t pagesize = mem_pagesize();
+    char *plo = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+    char *phi = (char *)((size_t)hi & ~(pagesize - 1));
+
+    if (plo < phi)
+	madvise(plo, phi - plo, MADV_DONTNEED);
+}
+
+/*
+ * mem_map - model an mmap region of len bytes outside the sbrk heap,
+ *    for allocators that serve large objects from dedicated chunks.
+ *    Returns the region address, or NULL when the OS refuses.
+ */
+void *mem_map(size_t len)
+{
+    void *base;
+    int i;
+
+#ifdef MM_THREADSAFE
+    while (__sync_lock_test_and_set(&mem_maplock, 1))
+	;
+#endif
+    for (i = 0; i < MEM_MAXMAPS && mem_maps[i].base != NULL; i++)
+	;
+    if (i == MEM_MAXMAPS) {
+	base = NULL;    /* table full: let the allocator fall back */
+    } else {
+	base = mmap(NULL, len, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+	    base = NULL;
+	} else {
+	    mem_maps[i].base = (char *)base;
+	    mem_maps[i].len = len;
+	    mem_map_size += len;
+	}
+    }
+#ifdef MM_THREADSAFE
+    __sync_lock_release(&mem_maplock);
+#endif
+    return base;
+}
+
+/*
+ * mem_unmap - return a region obtained from mem_map to the OS
+ */
+void mem_unmap(void *base, size_t len)
+{
+    int i;
+
+#ifdef MM_THREADSAFE
+    while (__sync_lock_test_and_set(&mem_maplock, 1))
+	;
+#endif
+    for (i = 0; i < MEM_MAXMAPS; i++) {
+	if (mem_maps[i].base == (char *)base) {
+	    mem_maps[i].base = NULL;
+	    mem_map_size -= len;
+	    break;
+	}
+    }
+#ifdef MM_THREADSAFE
+    __sync_lock_release(&mem_maplock);
+#endif
+    munmap(base, len);
+}
+
+/*
+ * mem_is_mapped - report whether [lo, hi] lies inside one live
+ *    mem_map region; the driver uses this to validate payloads that
+ *    are not in the sbrk heap
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    int i, in = 0;
+
+#ifdef MM_THREADSAFE
+    while (__sync_lock_test_and_set(&mem_maplock, 1))
+	;
+#endif
+    for (i = 0; i < MEM_MAXMAPS; i++) {
+	if (mem_maps[i].base != NULL && (char *)lo >= mem_maps[i].base &&
+	    (char *)hi < mem_maps[i].base + mem_maps[i].len) {
+	    in = 1;
+	    break;
+	}
+    }
+#ifdef MM_THREADSAFE
+    __sync_lock_release(&mem_maplock);
+#endif
+    return in;
+}
+
+/*
+ * mem_mapsize() - returns the bytes currently held by mem_map
+ *    regions, which live outside the range mem_heapsize covers
+ */
+size_t mem_mapsize()
+{
+    return mem_map_size;
+}
+
+/*
+ * mem_save - write the heap image and every live mem_map region to
+ *    (fp), so a later run can restore the exact memory state without
+ *    replaying the operations that produced it. The base addresses
+ *    are recorded too: mem_restore maps everything back in place,
+ *    which is what keeps pointers stored inside the heap valid.
+ */
+int mem_save(FILE *fp)
+{
+    size_t used = mem_brk - mem_start_brk;
+    size_t hiwater = mem_max_brk - mem_start_brk;
+    int i, nmaps = 0;
+
+    for (i = 0; i < MEM_MAXMAPS; i++)
+	if (mem_maps[i].base != NULL)
+	    nmaps++;
+    if (fwrite(&mem_start_brk, sizeof(char *), 1, fp) != 1 ||
+	fwrite(&used, sizeof(size_t), 1, fp) != 1 ||
+	fwrite(&hiwater, sizeof(size_t), 1, fp) != 1 ||
+	fwrite(&nmaps, sizeof(int), 1, fp) != 1)
+	return -1;
+    if (used > 0 && fwrite(mem_start_brk, 1, used, fp) != used)
+	return -1;
+    for (i = 0; i < MEM_MAXMAPS; i++) {
+	if (mem_maps[i].base == NULL)
+	    continue;
+	if (fwrite(&mem_maps[i].base, sizeof(char *), 1, fp) != 1 ||
+	    fwrite(&mem_maps[i].len, sizeof(size_t), 1, fp) != 1 ||
+	    fwrite(mem_maps[i].base, 1, mem_maps[i].len, fp)
+		!= mem_maps[i].len)
+	    return -1;
+    }
+    return 0;
+}
+
+/*
+ * mem_restore - map a state written by mem_save back at the addresses
+ *    it was taken at. Every recorded address must be free in this
+ *    process (true in practice: the reservations are large and land
+ *    in otherwise empty parts of the address space); nothing already
+ *    mapped is ever replaced. Returns 0 on success, -1 on fail.
+ */
+int mem_restore(FILE *fp)
+{
+    char *base;
+    size_t used, hiwater, len;
+    int i, nmaps;
+    void *m;
+#ifdef MAP_FIXED_NOREPLACE
+    int fixed = MAP_FIXED_NOREPLACE;
+#else
+    int fixed = 0;  /* fall back to letting mmap pick, then checking */
+#endif
+
+    if (fread(&base, sizeof(char *), 1, fp) != 1 ||
+	fread(&used, sizeof(size_t), 1, fp) != 1 ||
+	fread(&hiwater, sizeof(size_t), 1, fp) != 1 ||
+	fread(&nmaps, sizeof(int), 1, fp) != 1)
+	return -1;
+
+    /* the image only makes sense at the address it was taken at; if
+       this run's reservation landed elsewhere, move it there */
+    if (base != mem_start_brk) {
+	munmap(mem_start_brk, MAX_HEAP);
+	m = mmap(base, MAX_HEAP, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|fixed, -1, 0);
+	if (m != (void *)base) {
+	    fprintf(stderr, "mem_restore: cannot map heap at %p\n",
+		    (void *)base);
+	    if (m != MAP_FAILED)
+		munmap(m, MAX_HEAP);
+	    return -1;
+	}
+	mem_start_brk = base;
+	mem_max_addr = mem_start_brk + MAX_HEAP;
+    }
+    mem_brk = mem_start_brk + used;
+    mem_max_brk = mem_start_brk + hiwater;
+    if (used > 0 && fread(mem_start_brk, 1, used, fp) != used)
+	return -1;
+
+    /* drop any live regions, then recreate the saved ones in place */
+    for (i = 0; i < MEM_MAXMAPS; i++)
+	if (mem_maps[i].base != NULL)
+	    mem_unmap(mem_maps[i].base, mem_maps[i].len);
+    for (i = 0; i < nmaps; i++) {
+	if (fread(&base, sizeof(char *), 1, fp) != 1 ||
+	    fread(&len, sizeof(size_t), 1, fp) != 1)
+	    return -1;
+	m = mmap(base, len, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|fixed, -1, 0);
+	if (m != (void *)base) {
+	    fprintf(stderr, "mem_restore: cannot map region at %p\n",
+		    (void *)base);
+	    if (m != MAP_FAILED)
+		munmap(m, len);
+	    return -1;
+	}
+	if (fread(base, 1, len, fp) != len)
+	    return -1;
+	mem_maps[i].base = base;
+	mem_maps[i].len = len;
+	mem_map_size += len;
+    }
+    return 0;
+}
+
+/*
+ * mem_guard - make the physical pages fully inside [lo, hi)
+ *    inaccessible, so a stray access faults at the offending
+ *    instruction. The range stays reserved; pair with mem_unguard
+ *    before the allocator reuses it.
+ */
+void mem_guard(void *lo, void *hi)
+{
+    size_t pagesize = mem_pagesize();
+    char *plo = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+    char *phi = (char *)((size_t)hi & ~(pagesize - 1));
+
+    if (plo < phi)
+	mprotect(plo, phi - plo, PROT_NONE);
+}
+
+/*
+ * mem_unguard - make pages guarded by mem_guard accessible again.
+ *    Harmless on pages that were never guarded.
+ */
+void mem_unguard(void *lo, void *hi)
+{
+    size_t pagesize = mem_pagesize();
+    char *plo = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+    char *phi = (char *)((size_t)hi & ~(pagesize - 1));
+
+    if (plo < phi)
+	mprotect(plo, phi - plo, PROT_READ|PROT_WRITE);
 }
 
 /*
@@ -87,11 +374,20 @@ void *mem_heap_hi()
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
-size_t mem_heapsize() 
+size_t mem_heapsize()
 {
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_heap_hiwater() - returns the largest heap size seen so far,
+ *    which can exceed mem_heapsize() once the heap has been trimmed
+ */
+size_t mem_heap_hiwater()
+{
+    return (size_t)(mem_max_brk - mem_start_brk);
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -1,11 +1,22 @@
+#include <stdio.h>
 #include <unistd.h>
 
-void mem_init(void);               
+void mem_init(void);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void mem_decommit(void *lo, void *hi);
+void *mem_map(size_t len);
+void mem_unmap(void *base, size_t len);
+size_t mem_mapsize(void);
+int mem_is_mapped(void *lo, void *hi);
+int mem_save(FILE *fp);
+int mem_restore(FILE *fp);
+void mem_guard(void *lo, void *hi);
+void mem_unguard(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_heap_hiwater(void);
 size_t mem_pagesize(void);
 
@@ -1,8 +1,17 @@
 /*
  * mm.c - dynamic memory allocation
- * tracking free blocks: explicit free list
- * placement policy: first fit
- * ordering policy: LIFO
+ * tracking free blocks: segregated free lists for small blocks,
+ * size-ordered splay tree for large blocks
+ * placement policy: best fit
+ * ordering policy: LIFO (small classes); FIFO or address-ordered
+ * insertion selectable at build time (see MM_INSERT_* below)
+ * block format: allocated blocks carry a header only; free blocks
+ * carry header & footer. each header caches the allocated status of
+ * the previous block in bit 1, so coalesce never reads the footer of
+ * an allocated block.
+ * pointers: free list and tree links are stored as 4-byte heap
+ * offsets (in units of DWSIZE), never as raw addresses, so the same
+ * layout works for 32-bit and 64-bit builds.
  */
 
 #include <stdio.h>
@@ -13,6 +22,23 @@
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
+
+// machine- and trace-tuned defaults generated by `make tune`
+// (tune.sh writes mm_tuning.h); opted into with -DMM_TUNED so a
+// missing header never breaks a normal build
+#ifdef MM_TUNED
+#include "mm_tuning.h"
+#endif
+
+#ifdef MM_THREADSAFE
+#include <pthread.h>
+#endif
+
+#ifdef MM_HARDEN
+#include <fcntl.h>
+#include <time.h>
+#endif
 
 /*
  * constants & macros
@@ -20,19 +46,230 @@
 
 // word size: 4 bytes
 // alignment requirement: 2 words (8 bytes)
-// minimum block size: 4 words (16 bytes)
 // minimum heap extend size: 4 KB
+// per-block overhead HSIZE: one header word, plus an owner word in
+// the thread-safe build. minimum block size: a free block must hold
+// the overhead, two list links, and a footer
 #define WSIZE 4
 #define DWSIZE 8
-#define MINSIZE 16
+
+// round up to muptiple of DWSIZE
+#define ALIGN(size) (((size) + (DWSIZE - 1)) & ~0x7)
+
+#ifdef MM_THREADSAFE
+#define HSIZE DWSIZE
+#else
+#define HSIZE WSIZE
+#endif
+#define MINSIZE ALIGN(HSIZE + 3 * WSIZE)
 #define CHUNKSIZE (1 << 12)
 
-// allocated/free status
+// adaptive heap growth: an extension forced while the free lists are
+// nearly empty means demand is outpacing the heap, so the next
+// extension doubles (up to MM_GROW_MAX) and a ramping workload pays
+// for far fewer sbrk calls and epilogue rewrites; extending with
+// ample free space on hand means the last growth overshot, and the
+// size decays back toward CHUNKSIZE
+#ifndef MM_GROW_MAX
+#define MM_GROW_MAX (256 * CHUNKSIZE)
+#endif
+
+// thread-safe mode (build with -DMM_THREADSAFE): each thread gets its
+// own arena (own size class lists and tree) and heap extensions are
+// self-contained chunks framed by a forced previous-allocated bit and
+// a terminator header, so no operation ever touches another arena's
+// blocks. every block carries its owner's arena index in a word
+// before the header. a free from another thread does not touch the
+// owner's lock or lists at all: it pushes the block onto the owner
+// arena's lock-free MPSC remote-free stack (linked through the dead
+// payload), which the owner drains inside malloc when its free lists
+// miss. the same-thread lock is uncontended.
+#ifdef MM_THREADSAFE
+#define MM_MAXARENA 64
+#ifdef MM_SLAB
+#error "MM_SLAB is not supported together with MM_THREADSAFE"
+#endif
+#ifdef MM_DEFER_COALESCE
+#error "MM_DEFER_COALESCE is not supported together with MM_THREADSAFE"
+#endif
+#endif
+
+// large object path: requests needing MM_MMAP_THRESH bytes or more
+// are served from dedicated mem_map chunks outside the sbrk heap and
+// returned to the OS the moment they are freed, so giant blocks never
+// sit in the free lists or hold the heap high-water mark up forever.
+// a mapped block is recognized by its address alone: every sbrk block
+// lives below the current break
+#ifndef MM_MMAP_THRESH
+#define MM_MMAP_THRESH (1 << 16)
+#endif
+#define MAPPED(ptr) ((char *)(ptr) < heap_base || \
+                     (char *)(ptr) > (char *)mem_heap_hi())
+
+// heap trim: a free block at the top of the heap larger than
+// MM_TRIM_THRESH is cut back to CHUNKSIZE, returning the excess to
+// the OS via a negative sbrk plus decommit
+#ifndef MM_TRIM_THRESH
+#define MM_TRIM_THRESH (16 * CHUNKSIZE)
+#endif
+
+// number of small size classes
+// class i holds blocks of size [MINSIZE << i, MINSIZE << (i + 1));
+// blocks of TREESIZE bytes or more live in the splay tree instead
+#define NCLASS 5
+#define TREESIZE (MINSIZE << NCLASS)
+
+// the mm_stats histogram in mm.h has one bucket per class plus one
+// for the tree
+#if MM_NCLASS != NCLASS + 1
+#error "MM_NCLASS in mm.h must be NCLASS + 1"
+#endif
+
+// allocated/free status (header bit 0)
 #define ALLOCATED 1
 #define FREE 0
 
-// round up to muptiple of DWSIZE
-#define ALIGN(size) (((size) + (DWSIZE - 1)) & ~0x7)
+// previous block allocated status (header bit 1)
+#define PALLOC 0x2
+
+// grown-by-realloc status (header bit 2): set once mm_realloc has
+// grown a block, so the next upward realloc reserves geometric
+// headroom instead of growing exactly. MM_REALLOC_HEADROOM is the
+// reserve factor in halves: 3 = 1.5x the request, 2 = no headroom.
+#define GROWN 0x4
+#ifndef MM_REALLOC_HEADROOM
+#define MM_REALLOC_HEADROOM 3
+#endif
+
+// free list insertion policy for the small classes: LIFO head
+// insertion by default. -DMM_INSERT_FIFO queues frees at the list
+// tail instead, kept in the dummy head's otherwise unused pred word.
+// -DMM_INSERT_ADDR keeps each list sorted by address, so best-fit
+// ties go to the lowest block and long-lived heaps fragment less; to
+// keep insertion from walking whole lists, about a quarter of the
+// blocks also sit on a sparser express lane searched first, like a
+// two-level skip list. lane membership is flagged by header bit 2,
+// which free blocks never use for GROWN.
+#if defined(MM_INSERT_FIFO) && defined(MM_INSERT_ADDR)
+#error "MM_INSERT_FIFO and MM_INSERT_ADDR are mutually exclusive"
+#endif
+#ifdef MM_INSERT_ADDR
+#define EXPRESS 0x4
+#endif
+
+// deferred coalescing (build with -DMM_DEFER_COALESCE): freed blocks
+// go straight onto their free list uncoalesced, and a heap sweep
+// merges adjacent free blocks only when an allocation misses the free
+// lists or SWEEPTHRESH frees accumulate. trades some utilization for
+// throughput on free/malloc ping-pong workloads.
+#ifdef MM_DEFER_COALESCE
+#define SWEEPTHRESH 256
+#endif
+
+// small-object slab layer (build with -DMM_SLAB): requests of at most
+// SLABMAX bytes are served from per-size pools carved out of
+// page-sized slabs with a free bitmap, bypassing block headers and
+// the free lists on the hottest path. mm_free detects slab membership
+// from a per-page map indexed by heap offset.
+#ifdef MM_SLAB
+#define SLABMAX (MINSIZE * 8)
+#define NSLABPOOL (SLABMAX / DWSIZE)
+
+// slab descriptor at the start of each slab page; a set bitmap bit
+// marks a free object. objects follow the descriptor.
+typedef struct {
+    unsigned int osize;         // object size in bytes
+    unsigned int nfree;         // number of free objects
+    unsigned int pred;          // pred/succ slab in the pool's
+    unsigned int succ;          // partial-slab list
+    unsigned int bitmap[16];
+} slab_t;
+
+// objects per slab: page minus next block's header and descriptor
+#define SLABDESC ALIGN(sizeof(slab_t))
+#define SLABOBJ(base) ((char *)(base) + SLABDESC)
+#define NOBJ(osize) ((CHUNKSIZE - WSIZE - SLABDESC) / (osize))
+#endif
+
+// allocation event tracing (build with -DMM_TRACE): every successful
+// malloc, free, and realloc appends a 12-byte record to a fixed ring,
+// and mm_trace_dump writes the captured window out as a .rep trace
+// that mdriver can replay. reallocs take two adjacent records so the
+// old and new addresses both fit.
+#ifdef MM_TRACE
+#ifndef MM_TRACE_CAP
+#define MM_TRACE_CAP (1 << 18)      // ring capacity in records
+#endif
+
+#define TR_ALLOC   0
+#define TR_REALLOC 1                // always followed by TR_MOVED
+#define TR_FREE    2
+#define TR_MOVED   3                // new address of a realloc'd block
+#define TR_ALIGNSHIFT 8             // bits 8+ of op hold log2(alignment)
+                                    // for memalign requests (0 = none)
+
+typedef struct {
+    unsigned int op;                // TR_* code
+    unsigned int size;              // request size in bytes
+    unsigned int ofs;               // LINK() offset of the block
+} trace_rec_t;
+#endif
+
+// checked build (-DMM_CHECK): each operation validates the blocks it
+// touched as it finishes — header/footer match, free-list link
+// symmetry, no adjacent free blocks, intact epilogue — and mm_check()
+// sweeps the whole heap, free lists, and tree on demand. failures
+// print the offending block and abort, so corruption surfaces at the
+// op that caused it instead of thousands of ops later.
+#ifdef MM_CHECK
+#define CHECK_BLOCK(ptr) check_block(ptr)
+#else
+#define CHECK_BLOCK(ptr) ((void)0)
+#endif
+
+// hardened build (-DMM_HARDEN): free-list links are XOR-encoded with a
+// boot-time random secret, so a forged or corrupted link word decodes
+// to an unpredictable address instead of an attacker-chosen one, and
+// every allocated block carries a canary in its last word (one word of
+// padding keeps it clear of the payload), verified on free and
+// realloc. -DMM_HARDEN_GUARD additionally backs allocations of
+// HARDEN_GUARDSIZE bytes or more with an inaccessible guard page
+// between the payload and the canary, so a linear overrun faults at
+// the overrunning store; blocks reallocated in place keep their canary
+// but drop the guard
+#if defined(MM_HARDEN) && defined(MM_SLAB)
+#error MM_HARDEN does not support MM_SLAB (slab objects have no header)
+#endif
+#ifdef MM_HARDEN
+#define CANARY(ptr) ((unsigned int)((size_t)(ptr) >> 3) ^ canary_secret)
+#define HARDEN_SET(ptr) SET(FTR(ptr), CANARY(ptr))
+#define HARDEN_CHECK(ptr) harden_check(ptr)
+#else
+#define HARDEN_SET(ptr) ((void)0)
+#define HARDEN_CHECK(ptr) ((void)0)
+#endif
+#ifdef MM_HARDEN_GUARD
+#ifndef MM_HARDEN
+#error MM_HARDEN_GUARD requires MM_HARDEN
+#endif
+#ifndef HARDEN_GUARDSIZE
+#define HARDEN_GUARDSIZE (1 << 16)  // guard blocks of 64 KB and up
+#endif
+#endif
+
+// a wrapping mode interposes on the public entry points, and the main
+// function bodies then compile as the static *_arena functions
+#if defined(MM_THREADSAFE) || defined(MM_TRACE)
+#define MM_WRAPPED
+#endif
+
+#ifdef MM_TRACE
+#define TRACE(op, size, ptr) trace_event(op, size, ptr)
+#define TRACE_PAIR(size, oldptr, newptr) trace_event_pair(size, oldptr, newptr)
+#else
+#define TRACE(op, size, ptr) ((void)0)
+#define TRACE_PAIR(size, oldptr, newptr) ((void)0)
+#endif
 
 // read/write a word at ptr
 #define GET(ptr) (*(unsigned int *)(ptr))
@@ -42,26 +279,223 @@
 #define PACK(size, alloc) ((size) | (alloc))
 #define SIZE(hdr) (GET((hdr)) & ~0x7)
 #define ALLOC(hdr) (GET((hdr)) & 0x1)
+#define PREV_ALLOC(hdr) (GET((hdr)) & PALLOC)
 
 // get header/footer of block at ptr
 #define HDR(ptr) ((char *)(ptr) - WSIZE)
-#define FTR(ptr) ((char *)(ptr) + SIZE(HDR(ptr)) - DWSIZE)
+#define FTR(ptr) ((char *)(ptr) + SIZE(HDR(ptr)) - WSIZE - HSIZE)
 
-// prev/next block (both allocated/free)
+// prev/next block (PREV is only valid if the previous block is free,
+// as allocated blocks have no footer)
 #define NEXT(ptr) ((char *)(ptr) + SIZE((char *)(ptr) - WSIZE))
-#define PREV(ptr) ((char *)(ptr) - SIZE((char *)(ptr) - DWSIZE))
+#define PREV(ptr) ((char *)(ptr) - SIZE((char *)(ptr) - WSIZE - HSIZE))
 
-// pred/succ block in free list (only free)
+// owner arena of block at ptr (thread-safe build only)
+#ifdef MM_THREADSAFE
+#define OWNER(ptr) GET((char *)(ptr) - DWSIZE)
+#define SET_OWNER(ptr) SET((char *)(ptr) - DWSIZE, (unsigned int)(cur - arenas))
+#else
+#define SET_OWNER(ptr) ((void)0)
+#endif
+
+// encode/decode a 4-byte link word. links hold the DWSIZE-granular
+// heap offset of the target biased by 1, so 0 still means "no link"
+// and a 4-byte word can address far more than 4 GB of heap. the
+// hardened build additionally XORs the stored word with a secret whose
+// top bit is always set: plain offsets stay below 2^31 for any heap
+// this driver can model, so an encoded link never reads back as 0
+#ifdef MM_HARDEN
+#define LINK(p) ((p) == NULL ? 0 : \
+    ((unsigned int)((((char *)(p) - heap_base) >> 3) + 1) ^ link_secret))
+#define UNLINK(off) ((off) == 0 ? NULL : \
+    heap_base + (((size_t)((unsigned int)(off) ^ link_secret) - 1) << 3))
+#else
+#define LINK(p) ((p) == NULL ? 0 : \
+    (unsigned int)((((char *)(p) - heap_base) >> 3) + 1))
+#define UNLINK(off) ((off) == 0 ? NULL : \
+    heap_base + (((size_t)(off) - 1) << 3))
+#endif
+
+// pred/succ block in free list (only small free blocks)
 #define PRED(fbp) ((char *)(fbp))
 #define SUCC(fbp) ((char *)(fbp) + WSIZE)
 
-// head of free list (= prologue block)
-static char *head;
+#ifdef MM_INSERT_ADDR
+// express lane link, a third word after pred/succ; only blocks with
+// room for it beyond the footer can join the lane
+#define EXPR(fbp) ((char *)(fbp) + 2 * WSIZE)
+#endif
+
+// left/right child in splay tree (only large free blocks; the links
+// reuse the same two payload words as PRED/SUCC)
+#define LEFT(fbp) ((char *)(fbp))
+#define RIGHT(fbp) ((char *)(fbp) + WSIZE)
+
+// head of free list for class i (dummy node inside prologue block)
+#define HEAD(i) (heads + (i) * DWSIZE)
+
+// bottom of the heap: link offsets are relative to this
+static char *heap_base;
+
+#ifdef MM_HARDEN
+// boot-time secrets for link encoding and block canaries
+static unsigned int link_secret;
+static unsigned int canary_secret;
+#endif
+
+#ifdef MM_THREADSAFE
+// per-thread arena: its own size class heads, tree root, and splay
+// scratch node, all carved from the heap so links stay 4 bytes
+typedef struct {
+    char *heads;
+    char *root;
+    char *scratch;
+#ifdef MM_INSERT_ADDR
+    char *eheads[NCLASS];           // express lane heads, one per class
+#endif
+    size_t grow_next;               // adaptive heap extension size
+    volatile unsigned int remote;   // MPSC stack of remotely freed blocks
+    size_t occ_live;                // occupancy counters (see mm_stats)
+    size_t occ_free;
+    size_t occ_nfree;
+    int gen;                        // heap_gen this arena was carved for
+    pthread_mutex_t lock;
+} arena_t;
+
+static arena_t arenas[MM_MAXARENA];
+static int narena;
+static int heap_gen;                    // bumped by mm_init
+static pthread_mutex_t reglock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread int myarena = -1;       // this thread's arena index
+static __thread int mygen;              // heap_gen the index belongs to
+static __thread arena_t *cur;           // arena bound to the running op
+
+// the helpers below address whichever arena the entry point bound
+#define heads (cur->heads)
+#define root (cur->root)
+#define scratch (cur->scratch)
+#ifdef MM_INSERT_ADDR
+#define eheads (cur->eheads)
+#endif
+#define grow_next (cur->grow_next)
+#define occ_live (cur->occ_live)
+#define occ_free (cur->occ_free)
+#define occ_nfree (cur->occ_nfree)
+#else
+// first dummy node of the size class heads
+static char *heads;
+
+// root of the splay tree of large free blocks
+static char *root;
+
+// scratch tree node used by splay (inside prologue block, so its
+// address fits in a 4-byte link)
+static char *scratch;
+
+#ifdef MM_INSERT_ADDR
+// first express lane node of each size class
+static char *eheads[NCLASS];
+#endif
+
+// incremental occupancy counters reported by mm_stats: bytes in
+// allocated blocks, bytes in free blocks, and the free block count
+static size_t occ_live;
+static size_t occ_free;
+static size_t occ_nfree;
+
+// [clean_lo, clean_hi): heap bytes above the all-time high-water mark
+// of the latest extension, i.e. memory that has never held user data.
+// mm_calloc skips the memset for blocks carved entirely from here;
+// frees raise clean_lo past the (possibly dirtied) freed payload
+static char *clean_lo;
+static char *clean_hi;
+
+// next heap extension size (adaptive, see MM_GROW_MAX)
+static size_t grow_next;
+#endif
+
+#ifdef MM_DEFER_COALESCE
+// uncoalesced frees since the last sweep
+static int nfreed;
+#endif
+
+#ifdef MM_SLAB
+// heads of the per-size partial-slab lists
+static char *slabpool[NSLABPOOL];
+
+// per-page slab membership map, indexed by heap offset / CHUNKSIZE
+static char slabmap[MAX_HEAP / CHUNKSIZE];
+#endif
+
+#ifdef MM_TRACE
+// allocation event ring; trace_head counts records ever appended, so
+// the live window is the last MM_TRACE_CAP of them
+static trace_rec_t trace_ring[MM_TRACE_CAP];
+static volatile unsigned int trace_head;
+#endif
 
 /*
  * definition of helper functions
  */
+static int class_index(size_t size);
+static void sort_ptrs(void **ptrs, size_t n);
+#ifdef MM_THREADSAFE
+static int arena_bind(void);
+static void arena_bind_owner(void *ptr);
+static int drain_remote(void);
+static int malloc_batch_arena(size_t size, size_t n, void **out);
+#endif
+#ifdef MM_WRAPPED
+static void *malloc_arena(size_t size);
+static void free_arena(void *ptr);
+static void *realloc_arena(void *ptr, size_t size);
+static void *memalign_arena(size_t alignment, size_t size);
+#endif
+#ifdef MM_HARDEN
+static void harden_init(void);
+static void harden_check(void *ptr);
+#endif
+#ifdef MM_CHECK
+static void check_fail(const char *msg, void *ptr);
+static void check_block(void *ptr);
+static size_t check_tree_walk(char *t, size_t *bytes);
+static void check_arena(void);
+#endif
+#ifdef MM_TRACE
+static void trace_event(int op, size_t size, void *ptr);
+static void trace_event_pair(size_t size, void *oldptr, void *newptr);
+static unsigned int trace_map_slot(unsigned int *keys, unsigned int mask,
+                                   unsigned int key);
+static void trace_pass(FILE *fp, unsigned int *keys, int *vals,
+                       unsigned int mask, int *nids, int *nops);
+#endif
+static void insert_block(void *ptr);
+static void remove_block(void *ptr);
+static char *splay(char *t, size_t ksize, char *kptr);
+static void tree_insert(char *ptr);
+static void tree_remove(char *ptr);
+static char *tree_fit(size_t asize);
+static void stats_arena(mm_stats_t *st);
+static void tree_stats(char *t, mm_stats_t *st);
+static void *find_fit(size_t asize);
+static void *extend_heap(size_t asize);
+static void *alloc_block(size_t asize);
+static void *mmap_alloc(size_t asize);
+static void place(void *ptr, size_t asize);
+static void free_block(void *ptr);
 static void *coalesce(void *ptr);
+#ifndef MM_THREADSAFE
+static void trim_top(void *ptr);
+#endif
+#ifdef MM_DEFER_COALESCE
+static void sweep(void);
+#endif
+#ifdef MM_SLAB
+static void *slab_alloc(size_t osize);
+static void slab_free(void *ptr, int idx);
+static char *slab_create(size_t osize);
+#endif
 
 /*
  * main functions (mm_init, mm_malloc, mm_free, mm_realloc)
@@ -71,122 +505,414 @@ static void *coalesce(void *ptr);
  * mm_init - initialize heap
  * return 0 on success, -1 on fail
  */
+#ifdef MM_THREADSAFE
+int mm_init() {
+    heap_base = (char *)mem_heap_lo();
+#ifdef MM_HARDEN
+    harden_init();
+#endif
+
+    // arenas are created lazily on each thread's first allocation;
+    // invalidate any arena bindings from a previous heap lifetime
+    pthread_mutex_lock(&reglock);
+    narena = 0;
+    heap_gen++;
+    pthread_mutex_unlock(&reglock);
+#ifdef MM_TRACE
+    trace_head = 0;
+#endif
+
+    return 0;
+}
+
+/*
+ * arena_bind - bind cur to the calling thread's arena and lock it,
+ * creating the arena on the thread's first allocation
+ * return 0 on success, -1 on fail
+ */
+static int arena_bind(void) {
+    char *r;
+    int i;
+
+    if (myarena < 0 || mygen != heap_gen) {
+        pthread_mutex_lock(&reglock);
+        myarena = narena++ % MM_MAXARENA;       // share arenas if exceeded
+        mygen = heap_gen;
+        cur = &arenas[myarena];
+        if (cur->gen == heap_gen) {
+            // already carved this heap lifetime: a thread sharing the
+            // arena, or state brought back by mm_state_restore
+            pthread_mutex_unlock(&reglock);
+            pthread_mutex_lock(&cur->lock);
+            return 0;
+        }
+        cur->gen = heap_gen;                    // claim before unlocking
+        pthread_mutex_init(&cur->lock, NULL);
+        pthread_mutex_unlock(&reglock);
+        pthread_mutex_lock(&cur->lock);
+
+        // carve the class head dummies and splay scratch node
+        if ((r = mem_sbrk((2 * NCLASS + 2) * WSIZE)) == (void *)-1) {
+            pthread_mutex_unlock(&cur->lock);
+            cur->gen = heap_gen - 1;
+            myarena = -1;
+            return -1;
+        }
+        heads = r;
+        for (i = 0; i < NCLASS; i++) {
+            SET(PRED(HEAD(i)), 0);
+            SET(SUCC(HEAD(i)), 0);
+#ifdef MM_INSERT_ADDR
+            eheads[i] = NULL;
+#endif
+        }
+        scratch = HEAD(NCLASS);
+        root = NULL;
+        grow_next = CHUNKSIZE;
+        cur->remote = 0;
+        occ_live = occ_free = occ_nfree = 0;
+        return 0;
+    }
+    cur = &arenas[myarena];
+    pthread_mutex_lock(&cur->lock);
+    return 0;
+}
+
+/*
+ * arena_bind_owner - bind cur to the arena owning block (ptr), and
+ * lock it
+ */
+static void arena_bind_owner(void *ptr) {
+    cur = &arenas[OWNER(ptr)];
+    pthread_mutex_lock(&cur->lock);
+}
+
+/*
+ * drain_remote - free every block on the bound arena's remote-free
+ * stack; runs under the arena lock, so only the atomic swap of the
+ * stack head races with remote pushers
+ * return the number of blocks drained
+ */
+static int drain_remote(void) {
+    char *ptr, *next;
+    unsigned int top;
+    int n = 0;
+
+    // latch the swapped head first: UNLINK evaluates its argument twice
+    top = __sync_lock_test_and_set(&cur->remote, 0);
+    ptr = (char *)UNLINK(top);
+    while (ptr != NULL) {
+        next = (char *)UNLINK(GET(PRED(ptr)));
+        free_block(ptr);
+        ptr = next;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * mm_malloc / mm_free / mm_realloc - lock-wrapping entry points; the
+ * implementations below run with the bound arena's lock held
+ */
+void *mm_malloc(size_t size) {
+    void *ptr;
+
+    if (arena_bind() < 0) {
+        return NULL;
+    }
+    ptr = malloc_arena(size);
+    pthread_mutex_unlock(&cur->lock);
+    if (ptr != NULL) {
+        TRACE(TR_ALLOC, size, ptr);
+    }
+    return ptr;
+}
+
+void mm_free(void *ptr) {
+    arena_t *owner;
+    unsigned int old;
+
+    if (ptr == NULL) {
+        return;
+    }
+    TRACE(TR_FREE, 0, ptr);
+
+    // a mapped block never touches the owner's lists (and its address
+    // has no 4-byte link encoding): settle the owner's accounting and
+    // return the chunk to the OS right here, whoever the caller is
+    if (MAPPED(ptr)) {
+        HARDEN_CHECK(ptr);
+        arena_bind_owner(ptr);
+        occ_live -= SIZE(HDR(ptr));
+        pthread_mutex_unlock(&cur->lock);
+        mem_unmap((char *)ptr - DWSIZE, SIZE(HDR(ptr)) + DWSIZE);
+        return;
+    }
+
+    // same-thread (or shared-arena) free: take the uncontended lock
+    owner = &arenas[OWNER(ptr)];
+    if (myarena >= 0 && mygen == heap_gen && owner == &arenas[myarena]) {
+        cur = owner;
+        pthread_mutex_lock(&cur->lock);
+        free_arena(ptr);
+        pthread_mutex_unlock(&cur->lock);
+        return;
+    }
+
+    // cross-thread free: push onto the owner's remote-free stack,
+    // linking through the first payload word
+    HARDEN_CHECK(ptr);
+    do {
+        old = owner->remote;
+        SET(PRED(ptr), old);
+    } while (!__sync_bool_compare_and_swap(&owner->remote, old, LINK(ptr)));
+}
+
+void *mm_realloc(void *ptr, size_t size) {
+    void *newptr;
+
+    if (ptr == NULL) {
+        return mm_malloc(size);
+    }
+    arena_bind_owner(ptr);
+    newptr = realloc_arena(ptr, size);
+    pthread_mutex_unlock(&cur->lock);
+    if (size == 0) {
+        TRACE(TR_FREE, 0, ptr);
+    } else if (newptr != NULL) {
+        TRACE_PAIR(size, ptr, newptr);
+    }
+    return newptr;
+}
+
+void *mm_memalign(size_t alignment, size_t size) {
+    void *ptr;
+#ifdef MM_TRACE
+    unsigned int lg = 0;
+#endif
+
+    if (arena_bind() < 0) {
+        return NULL;
+    }
+    ptr = memalign_arena(alignment, size);
+    pthread_mutex_unlock(&cur->lock);
+#ifdef MM_TRACE
+    if (ptr != NULL) {
+        if (alignment > DWSIZE) {
+            while (((size_t)1 << lg) < alignment) {
+                lg++;
+            }
+        }
+        TRACE(TR_ALLOC | (lg << TR_ALIGNSHIFT), size, ptr);
+    }
+#endif
+    return ptr;
+}
+
+int mm_malloc_batch(size_t size, size_t n, void **out) {
+    int r;
+
+    if (arena_bind() < 0) {
+        return -1;
+    }
+    r = malloc_batch_arena(size, n, out);
+    pthread_mutex_unlock(&cur->lock);
+    return r;
+}
+
+/*
+ * mm_free_batch - free (n) blocks. the blocks may belong to different
+ * arenas, so runs cannot be fused under one lock here; address order
+ * still lets each arena coalesce neighbors as they arrive
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    size_t i;
+
+    if (n == 0) {
+        return;
+    }
+    sort_ptrs(ptrs, n);
+    for (i = 0; i < n; i++) {
+        mm_free(ptrs[i]);
+    }
+}
+#else /* !MM_THREADSAFE */
 int mm_init() {
-    char *heap_btm, *oldbrk;
+    char *heap_btm, *oldbrk, *hw;
+    int i;
+
+    heap_base = (char *)mem_heap_lo();
+#ifdef MM_HARDEN
+    harden_init();
+#endif
 
     // create prologue & epilogue block
-    if ((heap_btm = mem_sbrk(6 * WSIZE)) < 0) {
+    // prologue payload holds one dummy list node per size class,
+    // plus one scratch tree node for splay
+    if ((heap_btm = mem_sbrk((6 + 2 * NCLASS) * WSIZE)) < 0) {
         return -1;
     }
     SET(heap_btm, 0);
-    SET(heap_btm + (1 * WSIZE), PACK(4 * WSIZE, ALLOCATED));
-    SET(heap_btm + (2 * WSIZE), 0);
-    SET(heap_btm + (3 * WSIZE), 0);
-    SET(heap_btm + (4 * WSIZE), PACK(4 * WSIZE, ALLOCATED));
-    SET(heap_btm + (5 * WSIZE), PACK(0, ALLOCATED));
-    head = heap_btm + (2 * WSIZE);
-
-    // extend heap by (CHUNKSIZE) bytes
+    SET(heap_btm + (1 * WSIZE), PACK((4 + 2 * NCLASS) * WSIZE, ALLOCATED));
+    heads = heap_btm + (2 * WSIZE);
+    for (i = 0; i < NCLASS; i++) {
+        SET(PRED(HEAD(i)), 0);
+        SET(SUCC(HEAD(i)), 0);
+#ifdef MM_INSERT_ADDR
+        eheads[i] = NULL;
+#endif
+    }
+    scratch = HEAD(NCLASS);
+    root = NULL;
+    grow_next = CHUNKSIZE;
+    occ_live = occ_free = occ_nfree = 0;
+#ifdef MM_TRACE
+    trace_head = 0;
+#endif
+#ifdef MM_DEFER_COALESCE
+    nfreed = 0;
+#endif
+#ifdef MM_SLAB
+    for (i = 0; i < NSLABPOOL; i++) {
+        slabpool[i] = NULL;
+    }
+    memset(slabmap, 0, sizeof(slabmap));
+#endif
+    SET(heap_btm + ((4 + 2 * NCLASS) * WSIZE), PACK((4 + 2 * NCLASS) * WSIZE, ALLOCATED));
+    SET(heap_btm + ((5 + 2 * NCLASS) * WSIZE), PACK(0, ALLOCATED) | PALLOC);
+
+    // extend heap and create a free block of (CHUNKSIZE) bytes
+    hw = heap_base + mem_heap_hiwater();
     if ((oldbrk = mem_sbrk(CHUNKSIZE)) < 0) {
         return -1;
     }
-
-    // create a free block of (CHUNKSIZE) bytes
-    SET(HDR(oldbrk), PACK(CHUNKSIZE, FREE));
+    SET(HDR(oldbrk), PACK(CHUNKSIZE, FREE) | PALLOC);
     SET(FTR(oldbrk), PACK(CHUNKSIZE, FREE));
     SET(HDR(NEXT(oldbrk)), PACK(0, ALLOCATED));
-    SET(SUCC(head), (int)oldbrk);
-    SET(PRED(oldbrk), (int)head);
-    SET(SUCC(oldbrk), 0);
+    insert_block(oldbrk);
+    clean_lo = (oldbrk > hw) ? oldbrk : hw;
+    clean_hi = oldbrk + CHUNKSIZE;
 
     return 0;
 }
 
+#ifdef MM_TRACE
 /*
- * mm_malloc - allocate block by (size) bytes
- * return allocated block pointer on success, NULL on fail
+ * mm_malloc / mm_free / mm_realloc - tracing entry points; every
+ * successful request is appended to the event ring around the body
  */
 void *mm_malloc(size_t size) {
-    size_t asize, exsize, fsize;
-    char *newptr, *oldbrk, *prev, *first, *pred, *succ, *newfree;
+    void *ptr = malloc_arena(size);
 
-    // if size is zero, return NULL
-    if (size == 0) {
-        return NULL;
+    if (ptr != NULL) {
+        TRACE(TR_ALLOC, size, ptr);
     }
+    return ptr;
+}
 
-    // allocated size: aligned size + 2 words (for header/footer)
-    // asize cannot be smaller than MINSIZE
-    if (size <= MINSIZE - DWSIZE) {
-        asize = MINSIZE;
-    } else {
-        asize = ALIGN(size) + DWSIZE;
+void mm_free(void *ptr) {
+    if (ptr != NULL) {
+        TRACE(TR_FREE, 0, ptr);
     }
+    free_arena(ptr);
+}
 
-    // choose first fit free block
-    newptr = (char *)GET(SUCC(head));
-    if (newptr != NULL) {
-        while (newptr != NULL) {
-            if (SIZE(HDR(newptr)) >= asize) {
-                break;
-            }
-            newptr = (char *)GET(SUCC(newptr));
-        }
+void *mm_realloc(void *ptr, size_t size) {
+    void *newptr;
+
+    if (ptr == NULL) {
+        return mm_malloc(size);
     }
-    // if no fit found, extend heap
-    if (newptr == NULL) {
-        exsize = (asize > CHUNKSIZE) ? asize : CHUNKSIZE;
-        if ((oldbrk = mem_sbrk(exsize)) < 0) {
-            return NULL;
-        }
-        SET(HDR(oldbrk), PACK(exsize, FREE));
-        SET(FTR(oldbrk), PACK(exsize, FREE));
-        SET(HDR(NEXT(oldbrk)), PACK(0, ALLOCATED));
-
-        // coalesce and insert new free block
-        prev = PREV(oldbrk);
-        if (ALLOC(HDR(prev))) {
-            first = (char *)GET(SUCC(head));
-            SET(SUCC(head), (int)oldbrk);
-            SET(PRED(oldbrk), (int)head);
-            SET(SUCC(oldbrk), (int)first);
-            if (first != NULL) {
-                SET(PRED(first), (int)oldbrk);
+    newptr = realloc_arena(ptr, size);
+    if (size == 0) {
+        TRACE(TR_FREE, 0, ptr);
+    } else if (newptr != NULL) {
+        TRACE_PAIR(size, ptr, newptr);
+    }
+    return newptr;
+}
+
+void *mm_memalign(size_t alignment, size_t size) {
+    void *ptr = memalign_arena(alignment, size);
+    unsigned int lg = 0;
+
+    if (ptr != NULL) {
+        if (alignment > DWSIZE) {
+            while (((size_t)1 << lg) < alignment) {
+                lg++;
             }
-            newptr = oldbrk;
-        } else {
-            exsize += SIZE(HDR(prev));
-            SET(HDR(prev), PACK(exsize, FREE));
-            SET(FTR(prev), PACK(exsize, FREE));
-            newptr = prev;
         }
+        TRACE(TR_ALLOC | (lg << TR_ALIGNSHIFT), size, ptr);
     }
+    return ptr;
+}
+#endif /* MM_TRACE */
+#endif /* MM_THREADSAFE */
 
-    // modify asize to avoid block smaller than MINSIZE
-    fsize = SIZE(HDR(newptr));
-    if (fsize - asize < MINSIZE) {
-        asize = fsize;
+/*
+ * mm_malloc - allocate block by (size) bytes
+ * return allocated block pointer on success, NULL on fail
+ */
+#ifdef MM_WRAPPED
+static void *malloc_arena(size_t size) {
+#else
+void *mm_malloc(size_t size) {
+#endif
+    size_t asize;
+    char *newptr;
+
+    // if size is zero, return NULL
+    if (size == 0) {
+        return NULL;
     }
 
-    // set header/footer of allocated block
-    SET(HDR(newptr), PACK(asize, ALLOCATED));
-    SET(FTR(newptr), PACK(asize, ALLOCATED));
+#ifdef MM_SLAB
+    // serve small requests from the slab pools; fall through to the
+    // general allocator if no slab can be created
+    if (size <= SLABMAX) {
+        if ((newptr = slab_alloc(ALIGN(size))) != NULL) {
+            return newptr;
+        }
+    }
+#endif
 
-    // remove allocated block from free list
-    pred = (char *)GET(PRED(newptr));
-    succ = (char *)GET(SUCC(newptr));
-    SET(SUCC(pred), (int)succ);
-    if (succ != NULL) {
-        SET(PRED(succ), (int)pred);
+    // allocated size: aligned size + HSIZE overhead (no footer on
+    // allocated blocks). asize cannot be smaller than MINSIZE, as a
+    // freed block needs header/footer plus two free list links.
+    // hardened blocks reserve one more word so the canary in the last
+    // word never overlaps the payload
+#ifdef MM_HARDEN
+    asize = ALIGN(size + HSIZE + WSIZE);
+#else
+    asize = ALIGN(size + HSIZE);
+#endif
+    if (asize < MINSIZE) {
+        asize = MINSIZE;
+    }
+#ifdef MM_HARDEN_GUARD
+    // large blocks get two pages of slack so at least one whole page
+    // fits between the payload and the canary
+    if (asize >= HARDEN_GUARDSIZE) {
+        asize += 2 * mem_pagesize();
     }
+#endif
 
-    // create remaining free block if it exists
-    if (asize < fsize) {
-        newfree = NEXT(newptr);
-        SET(HDR(newfree), PACK(fsize - asize, FREE));
-        SET(FTR(newfree), PACK(fsize - asize, FREE));
-        coalesce(newfree);
+    // large requests bypass the free lists entirely: a dedicated map
+    // comes back to the OS on free instead of lingering in a list
+    if (asize >= MM_MMAP_THRESH) {
+        newptr = mmap_alloc(asize);
+    } else {
+        newptr = alloc_block(asize);
+    }
+    if (newptr == NULL) {
+        return NULL;
+    }
+    HARDEN_SET(newptr);
+#ifdef MM_HARDEN_GUARD
+    if (asize >= HARDEN_GUARDSIZE) {
+        mem_guard(newptr + size, FTR(newptr));
     }
+#endif
 
     return newptr;
 }
@@ -194,15 +920,31 @@ void *mm_malloc(size_t size) {
 /*
  * mm_free - free block in (ptr)
  */
+#ifdef MM_WRAPPED
+static void free_arena(void *ptr) {
+#else
 void mm_free(void *ptr) {
-    size_t size;
+#endif
+#ifdef MM_SLAB
+    int idx;
+#endif
 
     if (ptr != NULL) {
-        // set header/footer of freed block and coalesce
-        size = SIZE(HDR(ptr));
-        SET(HDR(ptr), PACK(size, FREE));
-        SET(FTR(ptr), PACK(size, FREE));
-        coalesce(ptr);
+        if (MAPPED(ptr)) {
+            HARDEN_CHECK(ptr);
+            occ_live -= SIZE(HDR(ptr));
+            mem_unmap((char *)ptr - DWSIZE, SIZE(HDR(ptr)) + DWSIZE);
+            return;
+        }
+#ifdef MM_SLAB
+        idx = ((char *)ptr - (char *)mem_heap_lo()) / CHUNKSIZE;
+        if (slabmap[idx]) {
+            slab_free(ptr, idx);
+            return;
+        }
+#endif
+        HARDEN_CHECK(ptr);
+        free_block(ptr);
     }
 }
 
@@ -210,185 +952,1966 @@ void mm_free(void *ptr) {
  * mm_realloc - free block in (ptr) and reallocate it by (size) bytes
  * return reallocated block pointer on success, NULL on fail
  */
+#ifdef MM_WRAPPED
+static void *realloc_arena(void *ptr, size_t size) {
+#else
 void *mm_realloc(void *ptr, size_t size) {
-    size_t oldsize, asize, exsize, fsize, smallsize;
-    char *newptr, *oldbrk, *prev, *first, *pred, *succ, *newfree;
+#endif
+    size_t oldsize, asize, smallsize, avail;
+    char *newptr, *next, *newfree;
+    int attop, grown;
+#ifdef MM_SLAB
+    slab_t *sp;
+    int idx;
+#endif
 
-    if (ptr != NULL) {
+    // mapped blocks resize by map/copy/unmap; a shrink keeps the
+    // chunk as long as the request still fills it, and grows reserve
+    // geometric headroom so growth loops do not copy every time
+    // (checked first: the slab map is indexed by sbrk heap offset)
+    if (ptr != NULL && MAPPED(ptr)) {
+        HARDEN_CHECK(ptr);
+#ifdef MM_HARDEN_GUARD
+        // the copy below must be able to read the whole old payload
+        mem_unguard(ptr, FTR(ptr));
+#endif
         oldsize = SIZE(HDR(ptr));
+        if (size == 0) {
+            occ_live -= oldsize;
+            mem_unmap((char *)ptr - DWSIZE, oldsize + DWSIZE);
+            return NULL;
+        }
+#ifdef MM_HARDEN
+        asize = ALIGN(size + HSIZE + WSIZE);
+#else
+        asize = ALIGN(size + HSIZE);
+#endif
+        if (asize <= oldsize) {
+            return ptr;
+        }
+        asize = ALIGN(asize * MM_REALLOC_HEADROOM / 2);
+        if ((newptr = mmap_alloc(asize)) == NULL) {
+            return NULL;
+        }
+        smallsize = oldsize - HSIZE;
+#ifdef MM_HARDEN
+        smallsize -= WSIZE;     // the canary word is not payload
+#endif
+        if (smallsize > size) {
+            smallsize = size;
+        }
+        memcpy(newptr, ptr, smallsize);
+        occ_live -= oldsize;
+        mem_unmap((char *)ptr - DWSIZE, oldsize + DWSIZE);
+        HARDEN_SET(newptr);
+        return newptr;
+    }
+
+#ifdef MM_SLAB
+    // slab objects have no header: take their size from the slab
+    // descriptor and move them with malloc/copy/free
+    if (ptr != NULL) {
+        idx = ((char *)ptr - (char *)mem_heap_lo()) / CHUNKSIZE;
+        if (slabmap[idx]) {
+            if (size == 0) {
+                slab_free(ptr, idx);
+                return NULL;
+            }
+            sp = (slab_t *)((char *)mem_heap_lo() + idx * CHUNKSIZE);
+#ifdef MM_WRAPPED
+            if ((newptr = malloc_arena(size)) == NULL) {
+#else
+            if ((newptr = mm_malloc(size)) == NULL) {
+#endif
+                return NULL;
+            }
+            smallsize = (sp->osize < size) ? sp->osize : size;
+            memcpy(newptr, ptr, smallsize);
+            slab_free(ptr, idx);
+            return newptr;
+        }
+    }
+#endif
+
+#ifndef MM_WRAPPED
+    // without an old block, realloc is plain malloc; checked before
+    // the free path below so realloc(NULL, 0) does not touch a header
+    // (the wrapping entry points handle this before dispatching here)
+    if (ptr == NULL) {
+        return mm_malloc(size);
     }
+#endif
 
     // if size is zero, free and return NULL
     if (size == 0) {
-        if (ptr != NULL) {
-            SET(HDR(ptr), PACK(oldsize, FREE));
-            SET(FTR(ptr), PACK(oldsize, FREE));
-            coalesce(ptr);
-        }
+        HARDEN_CHECK(ptr);
+        free_block(ptr);
         return NULL;
     }
 
-    // allocated size: aligned size + 2 words (for header/footer)
-    // asize cannot be smaller than MINSIZE
-    if (size <= MINSIZE - DWSIZE) {
-        asize = MINSIZE;
-    } else {
-        asize = ALIGN(size) + DWSIZE;
+    HARDEN_CHECK(ptr);
+#ifdef MM_HARDEN_GUARD
+    // the in-place paths below write inside the block, so drop any
+    // guard page up front; a moved block picks up a fresh one
+    if (SIZE(HDR(ptr)) >= HARDEN_GUARDSIZE) {
+        mem_unguard(ptr, NEXT(ptr));
     }
+#endif
 
-    // choose first fit free block
-    newptr = (char *)GET(SUCC(head));
-    if (newptr != NULL) {
-        while (newptr != NULL) {
-            if (SIZE(HDR(newptr)) >= asize) {
-                break;
-            }
-            newptr = (char *)GET(SUCC(newptr));
-        }
+    // allocated size: aligned size + HSIZE overhead (no footer on
+    // allocated blocks). asize cannot be smaller than MINSIZE, as a
+    // freed block needs header/footer plus two free list links
+#ifdef MM_HARDEN
+    asize = ALIGN(size + HSIZE + WSIZE);
+#else
+    asize = ALIGN(size + HSIZE);
+#endif
+    if (asize < MINSIZE) {
+        asize = MINSIZE;
     }
-    // if no fit found, extend heap
-    if (newptr == NULL) {
-        exsize = (asize > CHUNKSIZE) ? asize : CHUNKSIZE;
-        if ((oldbrk = mem_sbrk(exsize)) < 0) {
-            return NULL;
-        }
-        SET(HDR(oldbrk), PACK(exsize, FREE));
-        SET(FTR(oldbrk), PACK(exsize, FREE));
-        SET(HDR(NEXT(oldbrk)), PACK(0, ALLOCATED));
-
-        // coalesce and insert new free block
-        prev = PREV(oldbrk);
-        if (ALLOC(HDR(prev))) {
-            first = (char *)GET(SUCC(head));
-            SET(SUCC(head), (int)oldbrk);
-            SET(PRED(oldbrk), (int)head);
-            SET(SUCC(oldbrk), (int)first);
-            if (first != NULL) {
-                SET(PRED(first), (int)oldbrk);
+    oldsize = SIZE(HDR(ptr));
+    grown = GET(HDR(ptr)) & GROWN;
+
+    // shrink in place, splitting off the tail if it is large enough.
+    // a block that has been grown keeps its headroom until most of it
+    // is unused, so grow/shrink ping-pong does not thrash the lists
+    if (asize <= oldsize) {
+        if (oldsize - asize >= MINSIZE &&
+            (!grown || oldsize - asize >= oldsize / 2)) {
+            SET(HDR(ptr), PACK(asize, ALLOCATED) | PREV_ALLOC(HDR(ptr)));
+            HARDEN_SET(ptr);
+            occ_live -= oldsize - asize;
+#ifndef MM_THREADSAFE
+            // the split-off tail was user-visible payload
+            if ((char *)ptr + oldsize > clean_lo && (char *)ptr < clean_hi) {
+                clean_lo = (char *)ptr + oldsize;
             }
-            newptr = oldbrk;
-        } else {
-            exsize += SIZE(HDR(prev));
-            SET(HDR(prev), PACK(exsize, FREE));
-            SET(FTR(prev), PACK(exsize, FREE));
-            newptr = prev;
+#endif
+            newfree = NEXT(ptr);
+            SET(HDR(newfree), PACK(oldsize - asize, FREE) | PALLOC);
+            SET(FTR(newfree), PACK(oldsize - asize, FREE));
+            SET_OWNER(newfree);
+            coalesce(newfree);
         }
+        CHECK_BLOCK(ptr);
+        return ptr;
     }
 
-    // modify asize to avoid block smaller than MINSIZE
-    fsize = SIZE(HDR(newptr));
-    if (fsize - asize < MINSIZE) {
-        asize = fsize;
+    // a repeatedly grown block reserves headroom beyond the request,
+    // absorbing later grows with no list surgery or copying at all
+    if (grown) {
+        asize = ALIGN(asize * MM_REALLOC_HEADROOM / 2);
     }
 
-    // set header/footer of allocated block
-    SET(HDR(newptr), PACK(asize, ALLOCATED));
-    SET(FTR(newptr), PACK(asize, ALLOCATED));
-
-    // remove allocated block from free list
-    // BEFORE COPY to preserve old data
-    pred = (char *)GET(PRED(newptr));
-    succ = (char *)GET(SUCC(newptr));
-    SET(SUCC(pred), (int)succ);
-    if (succ != NULL) {
-        SET(PRED(succ), (int)pred);
+    // grow in place: absorb a free next block, and extend the heap
+    // directly when the block (plus a free neighbor) reaches the
+    // epilogue, before falling back to allocate-copy-free
+    next = NEXT(ptr);
+    avail = oldsize;
+    if (!ALLOC(HDR(next))) {
+        avail += SIZE(HDR(next));
+    }
+#ifdef MM_THREADSAFE
+    // chunk terminators look like the epilogue, so only the copy path
+    // can grow past a chunk
+    attop = 0;
+#else
+    attop = (SIZE(HDR((char *)ptr + avail)) == 0);
+#endif
+    if (avail >= asize || attop) {
+        if (avail < asize && mem_sbrk(asize - avail) == (void *)-1) {
+            // heap exhausted; try the copy path below
+        } else {
+            if (!ALLOC(HDR(next))) {
+                remove_block(next);
+            }
+            if (avail < asize) {
+                // extended: block now runs up to the new epilogue
+                SET(HDR(ptr), PACK(asize, ALLOCATED) | PREV_ALLOC(HDR(ptr)) | GROWN);
+                SET(HDR(NEXT(ptr)), PACK(0, ALLOCATED) | PALLOC);
+                occ_live += asize - oldsize;
+            } else if (avail - asize >= MINSIZE) {
+                SET(HDR(ptr), PACK(asize, ALLOCATED) | PREV_ALLOC(HDR(ptr)) | GROWN);
+                occ_live += asize - oldsize;
+                newfree = NEXT(ptr);
+                SET(HDR(newfree), PACK(avail - asize, FREE) | PALLOC);
+                SET(FTR(newfree), PACK(avail - asize, FREE));
+                SET_OWNER(newfree);
+                coalesce(newfree);
+            } else {
+                SET(HDR(ptr), PACK(avail, ALLOCATED) | PREV_ALLOC(HDR(ptr)) | GROWN);
+                SET(HDR(NEXT(ptr)), GET(HDR(NEXT(ptr))) | PALLOC);
+                occ_live += avail - oldsize;
+            }
+            HARDEN_SET(ptr);
+            CHECK_BLOCK(ptr);
+            return ptr;
+        }
     }
 
-    if (ptr != NULL) {
-        // copy old data
-        smallsize = (oldsize < asize) ? oldsize : asize;
-        memcpy(newptr, ptr, (smallsize - DWSIZE));
-
-        // set header/footer of freed block and coalesce
-        // AFTER COPY to preserve old data
-        SET(HDR(ptr), PACK(oldsize, FREE));
-        SET(FTR(ptr), PACK(oldsize, FREE));
-        coalesce(ptr);
+    if (asize >= MM_MMAP_THRESH) {
+        newptr = mmap_alloc(asize);
+    } else {
+        newptr = alloc_block(asize);
+    }
+    if (newptr == NULL) {
+        return NULL;
     }
 
-    // create remaining free block if it exists
-    if (asize < fsize) {
-        newfree = NEXT(newptr);
-        SET(HDR(newfree), PACK(fsize - asize, FREE));
-        SET(FTR(newfree), PACK(fsize - asize, FREE));
-        coalesce(newfree);
+    // copy old data, then free old block
+    // FREE AFTER COPY to preserve old data
+    smallsize = (oldsize < asize) ? oldsize : asize;
+    memcpy(newptr, ptr, (smallsize - HSIZE));
+    free_block(ptr);
+    if (!MAPPED(newptr)) {
+        SET(HDR(newptr), GET(HDR(newptr)) | GROWN);
     }
+    HARDEN_SET(newptr);
 
     return newptr;
 }
 
 /*
- * helper functions
+ * mm_calloc - allocate a zeroed block of (nmemb * size) bytes.
+ * blocks carved entirely from the virgin band — memory the heap has
+ * never handed out, zero since mem_init's mapping — only need their
+ * few metadata words cleared; recycled blocks take the full memset
  */
+void *mm_calloc(size_t nmemb, size_t size) {
+    size_t bytes = nmemb * size;
+    char *ptr;
+#if defined(MM_SLAB) && !defined(MM_THREADSAFE)
+    int idx;
+#endif
+
+    if (nmemb != 0 && bytes / nmemb != size) {
+        return NULL;
+    }
+    if ((ptr = mm_malloc(bytes)) == NULL) {
+        return NULL;
+    }
+    // a mapped block is fresh from the OS and therefore zero
+    if (MAPPED(ptr)) {
+        return ptr;
+    }
+#ifdef MM_THREADSAFE
+    // arenas interleave their chunks in the shared heap, so there is
+    // no cheap virgin-band test; zero unconditionally
+    memset(ptr, 0, bytes);
+#else
+#ifdef MM_SLAB
+    // slab objects have no header and recycle constantly
+    idx = (ptr - (char *)mem_heap_lo()) / CHUNKSIZE;
+    if (slabmap[idx]) {
+        memset(ptr, 0, bytes);
+        return ptr;
+    }
+#endif
+    if (ptr >= clean_lo && NEXT(ptr) <= clean_hi) {
+        // virgin block: only this block's own free-list links and the
+        // stale footer slot can be nonzero (merged blocks left the
+        // band when coalesce raised clean_lo past them)
+        SET(PRED(ptr), 0);
+        SET(SUCC(ptr), 0);
+#ifdef MM_INSERT_ADDR
+        SET(EXPR(ptr), 0);
+#endif
+#ifndef MM_HARDEN
+        SET(FTR(ptr), 0);       // hardened builds keep the canary there
+#endif
+    } else {
+        memset(ptr, 0, bytes);
+    }
+#endif
+    return ptr;
+}
 
 /*
- * coalesce - merge adjacent free blocks & modify free list
- * return merged block pointer
+ * mm_memalign - allocate (size) bytes with the payload on a multiple
+ * of (alignment), a power of two. over-allocates by the alignment
+ * plus one minimum block, slides the payload to the boundary, and
+ * returns the leading and trailing fragments through coalesce, so
+ * the only lasting cost is the fragments the neighbors cannot absorb
  */
-static void *coalesce(void *ptr) {
-    char *first, *prev, *next, *pred, *succ;
-    size_t prev_alloc, next_alloc, size;
+#ifdef MM_WRAPPED
+static void *memalign_arena(size_t alignment, size_t size) {
+#else
+void *mm_memalign(size_t alignment, size_t size) {
+#endif
+    size_t asize, total, lead;
+    char *ptr, *aligned, *newfree;
 
-    prev = PREV(ptr);
-    next = NEXT(ptr);
-    prev_alloc = ALLOC(HDR(prev));
-    next_alloc = ALLOC(HDR(next));
-    size = SIZE(HDR(ptr));
+    if (size == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    // the default alignment comes free on the normal path
+    if (alignment <= DWSIZE) {
+#ifdef MM_WRAPPED
+        return malloc_arena(size);
+#else
+        return mm_malloc(size);
+#endif
+    }
+
+#ifdef MM_HARDEN
+    asize = ALIGN(size + HSIZE + WSIZE);
+#else
+    asize = ALIGN(size + HSIZE);
+#endif
+    if (asize < MINSIZE) {
+        asize = MINSIZE;
+    }
+
+    // worst case needs room to slide by almost the whole alignment
+    // while leaving a leading fragment big enough to free on its own
+    if ((ptr = alloc_block(asize + alignment + MINSIZE)) == NULL) {
+        return NULL;
+    }
+    total = SIZE(HDR(ptr));
+    aligned = ptr;
+    if ((size_t)ptr % alignment != 0) {
+        aligned = (char *)(((size_t)ptr + MINSIZE + alignment - 1)
+                           & ~(alignment - 1));
+        lead = aligned - ptr;
+        SET(HDR(aligned), PACK(total - lead, ALLOCATED));
+        SET_OWNER(aligned);
+        SET(HDR(ptr), PACK(lead, FREE) | PREV_ALLOC(HDR(ptr)));
+        SET(FTR(ptr), PACK(lead, FREE));
+        occ_live -= lead;
+        coalesce(ptr);
+        total -= lead;
+    }
 
-    if (prev_alloc && next_alloc) {             // both are allocated
-        // insert ptr to free list
-        first = (char *)GET(SUCC(head));
-        SET(SUCC(head), (int)ptr);
-        SET(PRED(ptr), (int)head);
-        SET(SUCC(ptr), (int)first);
-        if (first != NULL) {
-            SET(PRED(first), (int)ptr);
+    // give back the tail beyond the request, as realloc's shrink does
+    if (total - asize >= MINSIZE) {
+        SET(HDR(aligned), PACK(asize, ALLOCATED) | PREV_ALLOC(HDR(aligned)));
+        occ_live -= total - asize;
+        newfree = NEXT(aligned);
+        SET(HDR(newfree), PACK(total - asize, FREE) | PALLOC);
+        SET(FTR(newfree), PACK(total - asize, FREE));
+        SET_OWNER(newfree);
+        coalesce(newfree);
+    }
+    HARDEN_SET(aligned);
+    CHECK_BLOCK(aligned);
+
+    return aligned;
+}
+
+/*
+ * mm_malloc_batch - allocate (n) blocks of (size) bytes each, served
+ * from one contiguous carve: a single fit search and one split loop
+ * instead of n full allocations. pointers are stored in (out)
+ * return 0 on success, -1 on fail (no blocks are allocated then)
+ */
+#ifdef MM_THREADSAFE
+static int malloc_batch_arena(size_t size, size_t n, void **out) {
+#else
+int mm_malloc_batch(size_t size, size_t n, void **out) {
+#endif
+    size_t asize, total, csize, i;
+    char *ptr;
+
+    if (n == 0) {
+        return 0;
+    }
+    if (size == 0) {
+        return -1;
+    }
+
+#ifdef MM_HARDEN
+    asize = ALIGN(size + HSIZE + WSIZE);
+#else
+    asize = ALIGN(size + HSIZE);
+#endif
+    if (asize < MINSIZE) {
+        asize = MINSIZE;
+    }
+    if (asize > (size_t)-1 / n) {
+        return -1;
+    }
+
+    // one carve for the whole batch; slabs are skipped even for small
+    // sizes, as their objects are not contiguous
+    if ((ptr = alloc_block(n * asize)) == NULL) {
+        return -1;
+    }
+    total = SIZE(HDR(ptr));
+    for (i = 0; i < n; i++) {
+        out[i] = ptr;
+        // the last block absorbs whatever slack the carve came with
+        csize = (i == n - 1) ? total - (n - 1) * asize : asize;
+        if (i == 0) {
+            SET(HDR(ptr), PACK(csize, ALLOCATED) | PREV_ALLOC(HDR(ptr)));
+        } else {
+            SET(HDR(ptr), PACK(csize, ALLOCATED) | PALLOC);
         }
-        return ptr;
+        SET_OWNER(ptr);
+        HARDEN_SET(ptr);
+        ptr = NEXT(ptr);
+    }
+#ifdef MM_CHECK
+    for (i = 0; i < n; i++) {
+        CHECK_BLOCK(out[i]);
+    }
+#endif
+#ifdef MM_TRACE
+    for (i = 0; i < n; i++) {
+        TRACE(TR_ALLOC, size, out[i]);
+    }
+#endif
+    return 0;
+}
+
+/*
+ * mm_free_batch - free (n) blocks at once. the pointers are sorted by
+ * address first, and runs of address-adjacent blocks are fused into
+ * one block before freeing, so the free lists see a single insert and
+ * coalesce per run instead of one per block
+ */
+#ifndef MM_THREADSAFE
+void mm_free_batch(void **ptrs, size_t n) {
+    size_t size, i, j;
+    char *ptr;
+#ifdef MM_SLAB
+    int idx;
+#endif
+
+    if (n == 0) {
+        return;
+    }
+    sort_ptrs(ptrs, n);
+    i = 0;
+    while (i < n) {
+        ptr = (char *)ptrs[i];
+        if (ptr == NULL) {
+            i++;
+            continue;
+        }
+        if (MAPPED(ptr)) {
+            HARDEN_CHECK(ptr);
+            TRACE(TR_FREE, 0, ptr);
+            occ_live -= SIZE(HDR(ptr));
+            mem_unmap(ptr - DWSIZE, SIZE(HDR(ptr)) + DWSIZE);
+            i++;
+            continue;
+        }
+#ifdef MM_SLAB
+        idx = (ptr - (char *)mem_heap_lo()) / CHUNKSIZE;
+        if (slabmap[idx]) {
+            TRACE(TR_FREE, 0, ptr);
+            slab_free(ptr, idx);
+            i++;
+            continue;
+        }
+#endif
+        HARDEN_CHECK(ptr);
+        TRACE(TR_FREE, 0, ptr);
+        size = SIZE(HDR(ptr));
+        j = i + 1;
+        while (j < n && ptr + size == (char *)ptrs[j]) {
+            if (MAPPED(ptrs[j])) {
+                break;
+            }
+#ifdef MM_SLAB
+            // a slab object may happen to sit right after the run
+            if (slabmap[((char *)ptrs[j] - (char *)mem_heap_lo())
+                        / CHUNKSIZE]) {
+                break;
+            }
+#endif
+            HARDEN_CHECK(ptrs[j]);
+            TRACE(TR_FREE, 0, ptrs[j]);
+            size += SIZE(HDR((char *)ptrs[j]));
+            j++;
+        }
+        if (j > i + 1) {
+            // fuse the run into one block before handing it over
+            SET(HDR(ptr), PACK(size, ALLOCATED) | PREV_ALLOC(HDR(ptr)));
+        }
+        free_block(ptr);
+        i = j;
+    }
+}
+#endif
+
+/*
+ * mm_stats - report heap occupancy: the incrementally maintained byte
+ * and block counters, plus a walk of the free lists for the per-class
+ * histogram and the largest free block. slab pages count as one live
+ * block each; their objects are not broken out.
+ */
+void mm_stats(mm_stats_t *st) {
+#ifdef MM_THREADSAFE
+    int i;
+#endif
+
+    memset(st, 0, sizeof(*st));
+    st->heap_size = mem_heapsize() + mem_mapsize();
+    st->heap_hiwater = mem_heap_hiwater();
+#ifdef MM_THREADSAFE
+    for (i = 0; i < narena && i < MM_MAXARENA; i++) {
+        cur = &arenas[i];
+        pthread_mutex_lock(&cur->lock);
+        stats_arena(st);
+        pthread_mutex_unlock(&cur->lock);
+    }
+#else
+    stats_arena(st);
+#endif
+}
+
+/*
+ * mm_state_save / mm_state_restore - write and read back the
+ * allocator's root state: everything live outside the heap image
+ * itself. Pairs with mem_save/mem_restore (memlib.c), which carry
+ * the heap bytes; together they snapshot a heap mid-run so a later
+ * process can resume replay without re-running the ops that built
+ * it. The heap layout depends on the compile-time flags, so restore
+ * refuses a snapshot taken by a differently configured build. The
+ * caller must be quiesced: no other thread inside the allocator,
+ * and under MM_TRACE the event ring is not carried across.
+ * return 0 on success, -1 on fail
+ */
+#define STATE_MAGIC 0x6d6d7374      // "mmst"
+
+// compile-time configuration fingerprint stored in snapshots
+static unsigned int state_config(void) {
+    unsigned int cfg = NCLASS << 16;
+
+#ifdef MM_THREADSAFE
+    cfg |= 0x1;
+#endif
+#ifdef MM_DEFER_COALESCE
+    cfg |= 0x2;
+#endif
+#ifdef MM_SLAB
+    cfg |= 0x4;
+#endif
+#ifdef MM_HARDEN
+    cfg |= 0x8;
+#endif
+#ifdef MM_HARDEN_GUARD
+    cfg |= 0x10;
+#endif
+#ifdef MM_INSERT_FIFO
+    cfg |= 0x20;
+#endif
+#ifdef MM_INSERT_ADDR
+    cfg |= 0x40;
+#endif
+    return cfg;
+}
+
+int mm_state_save(FILE *fp) {
+    unsigned int magic = STATE_MAGIC;
+    unsigned int cfg = state_config();
+#ifdef MM_SLAB
+    size_t mapped = mem_heapsize() / CHUNKSIZE + 1;
+#endif
+
+#ifdef MM_HARDEN_GUARD
+    // guarded free pages are unreadable and would make the image
+    // write fault; drop the guards (they re-arm as blocks recycle)
+    mem_unguard(heap_base, (char *)mem_heap_hi());
+#endif
+    if (fwrite(&magic, sizeof(magic), 1, fp) != 1 ||
+        fwrite(&cfg, sizeof(cfg), 1, fp) != 1 ||
+        fwrite(&heap_base, sizeof(heap_base), 1, fp) != 1) {
+        return -1;
+    }
+#ifdef MM_HARDEN
+    if (fwrite(&link_secret, sizeof(link_secret), 1, fp) != 1 ||
+        fwrite(&canary_secret, sizeof(canary_secret), 1, fp) != 1) {
+        return -1;
+    }
+#endif
+#ifdef MM_THREADSAFE
+    if (fwrite(&narena, sizeof(narena), 1, fp) != 1 ||
+        fwrite(arenas, sizeof(arena_t), MM_MAXARENA, fp) != MM_MAXARENA) {
+        return -1;
+    }
+#else
+    if (fwrite(&heads, sizeof(heads), 1, fp) != 1 ||
+        fwrite(&root, sizeof(root), 1, fp) != 1 ||
+        fwrite(&scratch, sizeof(scratch), 1, fp) != 1 ||
+        fwrite(&clean_lo, sizeof(clean_lo), 1, fp) != 1 ||
+        fwrite(&clean_hi, sizeof(clean_hi), 1, fp) != 1 ||
+        fwrite(&grow_next, sizeof(grow_next), 1, fp) != 1 ||
+        fwrite(&occ_live, sizeof(occ_live), 1, fp) != 1 ||
+        fwrite(&occ_free, sizeof(occ_free), 1, fp) != 1 ||
+        fwrite(&occ_nfree, sizeof(occ_nfree), 1, fp) != 1) {
+        return -1;
+    }
+#ifdef MM_INSERT_ADDR
+    if (fwrite(eheads, sizeof(eheads), 1, fp) != 1) {
+        return -1;
+    }
+#endif
+#endif
+#ifdef MM_DEFER_COALESCE
+    if (fwrite(&nfreed, sizeof(nfreed), 1, fp) != 1) {
+        return -1;
+    }
+#endif
+#ifdef MM_SLAB
+    if (fwrite(slabpool, sizeof(slabpool), 1, fp) != 1 ||
+        fwrite(&mapped, sizeof(mapped), 1, fp) != 1 ||
+        fwrite(slabmap, 1, mapped, fp) != mapped) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+int mm_state_restore(FILE *fp) {
+    unsigned int magic, cfg;
+#ifdef MM_THREADSAFE
+    int i, ninit;
+#endif
+#ifdef MM_SLAB
+    size_t mapped;
+#endif
+
+    if (fread(&magic, sizeof(magic), 1, fp) != 1 ||
+        fread(&cfg, sizeof(cfg), 1, fp) != 1 ||
+        magic != STATE_MAGIC || cfg != state_config()) {
+        return -1;
+    }
+    if (fread(&heap_base, sizeof(heap_base), 1, fp) != 1) {
+        return -1;
+    }
+#ifdef MM_HARDEN
+    if (fread(&link_secret, sizeof(link_secret), 1, fp) != 1 ||
+        fread(&canary_secret, sizeof(canary_secret), 1, fp) != 1) {
+        return -1;
+    }
+#endif
+#ifdef MM_THREADSAFE
+    if (fread(&narena, sizeof(narena), 1, fp) != 1 ||
+        fread(arenas, sizeof(arena_t), MM_MAXARENA, fp) != MM_MAXARENA) {
+        return -1;
+    }
+    // invalidate stale thread bindings, then mark the restored arenas
+    // as carved for the new generation; replay threads reattach to
+    // them in binding order instead of carving fresh ones
+    pthread_mutex_lock(&reglock);
+    heap_gen++;
+    ninit = (narena < MM_MAXARENA) ? narena : MM_MAXARENA;
+    for (i = 0; i < MM_MAXARENA; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        arenas[i].remote = 0;
+        arenas[i].gen = (i < ninit) ? heap_gen : heap_gen - 1;
+    }
+    narena = 0;
+    pthread_mutex_unlock(&reglock);
+#else
+    if (fread(&heads, sizeof(heads), 1, fp) != 1 ||
+        fread(&root, sizeof(root), 1, fp) != 1 ||
+        fread(&scratch, sizeof(scratch), 1, fp) != 1 ||
+        fread(&clean_lo, sizeof(clean_lo), 1, fp) != 1 ||
+        fread(&clean_hi, sizeof(clean_hi), 1, fp) != 1 ||
+        fread(&grow_next, sizeof(grow_next), 1, fp) != 1 ||
+        fread(&occ_live, sizeof(occ_live), 1, fp) != 1 ||
+        fread(&occ_free, sizeof(occ_free), 1, fp) != 1 ||
+        fread(&occ_nfree, sizeof(occ_nfree), 1, fp) != 1) {
+        return -1;
+    }
+#ifdef MM_INSERT_ADDR
+    if (fread(eheads, sizeof(eheads), 1, fp) != 1) {
+        return -1;
+    }
+#endif
+#endif
+#ifdef MM_DEFER_COALESCE
+    if (fread(&nfreed, sizeof(nfreed), 1, fp) != 1) {
+        return -1;
+    }
+#endif
+#ifdef MM_SLAB
+    if (fread(slabpool, sizeof(slabpool), 1, fp) != 1 ||
+        fread(&mapped, sizeof(mapped), 1, fp) != 1 ||
+        mapped > sizeof(slabmap) ||
+        fread(slabmap, 1, mapped, fp) != mapped) {
+        return -1;
+    }
+    memset(slabmap + mapped, 0, sizeof(slabmap) - mapped);
+#endif
+#ifdef MM_TRACE
+    trace_head = 0;
+#endif
+    return 0;
+}
+
+/*
+ * helper functions
+ */
+
+/*
+ * class_index - size class index for block of (size) bytes
+ */
+static int class_index(size_t size) {
+    size_t limit = MINSIZE << 1;
+    int i = 0;
+
+    while (i < NCLASS - 1 && size >= limit) {
+        limit <<= 1;
+        i++;
+    }
+    return i;
+}
+
+/*
+ * sort_ptrs - in-place shell sort of (n) pointers by address, so a
+ * batch free walks the heap in one direction
+ */
+static void sort_ptrs(void **ptrs, size_t n) {
+    size_t gap, i, j;
+    void *tmp;
+
+    for (gap = n / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < n; i++) {
+            tmp = ptrs[i];
+            for (j = i; j >= gap && ptrs[j - gap] > tmp; j -= gap) {
+                ptrs[j] = ptrs[j - gap];
+            }
+            ptrs[j] = tmp;
+        }
+    }
+}
+
+/*
+ * insert_block - insert free block into its size class list following
+ * the configured policy (LIFO head insert by default), or into the
+ * splay tree if it is large
+ */
+static void insert_block(void *ptr) {
+#if defined(MM_INSERT_FIFO)
+    char *head, *last;
+#elif defined(MM_INSERT_ADDR)
+    char *head, *prev, *next, *eprev, *enext;
+    int i;
+#else
+    char *head, *first;
+#endif
+
+    occ_free += SIZE(HDR(ptr));
+    occ_nfree++;
+    if (SIZE(HDR(ptr)) >= TREESIZE) {
+        tree_insert(ptr);
+        return;
+    }
+#if defined(MM_INSERT_FIFO)
+    // queue at the tail; the dummy head's pred word tracks the tail
+    head = HEAD(class_index(SIZE(HDR(ptr))));
+    last = (char *)UNLINK(GET(PRED(head)));
+    if (last == NULL) {
+        last = head;
+    }
+    SET(SUCC(last), LINK(ptr));
+    SET(PRED(ptr), LINK(last));
+    SET(SUCC(ptr), 0);
+    SET(PRED(head), LINK(ptr));
+#elif defined(MM_INSERT_ADDR)
+    i = class_index(SIZE(HDR(ptr)));
+    head = HEAD(i);
+    // ride the express lane to the last lane node below (ptr), then
+    // walk the list itself from there
+    eprev = NULL;
+    enext = eheads[i];
+    while (enext != NULL && enext < (char *)ptr) {
+        eprev = enext;
+        enext = (char *)UNLINK(GET(EXPR(enext)));
+    }
+    prev = (eprev != NULL) ? eprev : head;
+    next = (char *)UNLINK(GET(SUCC(prev)));
+    while (next != NULL && next < (char *)ptr) {
+        prev = next;
+        next = (char *)UNLINK(GET(SUCC(next)));
+    }
+    SET(SUCC(prev), LINK(ptr));
+    SET(PRED(ptr), LINK(prev));
+    SET(SUCC(ptr), LINK(next));
+    if (next != NULL) {
+        SET(PRED(next), LINK(ptr));
+    }
+    // promote about a quarter of the blocks with room for the lane
+    // word, picked by their (fixed) address bits
+    if (SIZE(HDR(ptr)) >= MINSIZE + DWSIZE &&
+        ((((size_t)ptr) >> 4) & 0x3) == 0) {
+        SET(HDR(ptr), GET(HDR(ptr)) | EXPRESS);
+        SET(EXPR(ptr), LINK(enext));
+        if (eprev != NULL) {
+            SET(EXPR(eprev), LINK(ptr));
+        } else {
+            eheads[i] = (char *)ptr;
+        }
+    }
+#else
+    head = HEAD(class_index(SIZE(HDR(ptr))));
+    first = (char *)UNLINK(GET(SUCC(head)));
+    SET(SUCC(head), LINK(ptr));
+    SET(PRED(ptr), LINK(head));
+    SET(SUCC(ptr), LINK(first));
+    if (first != NULL) {
+        SET(PRED(first), LINK(ptr));
+    }
+#endif
+}
+
+/*
+ * remove_block - remove free block from its size class list,
+ * or from the splay tree if it is large
+ */
+static void remove_block(void *ptr) {
+    char *pred, *succ;
+#if defined(MM_INSERT_FIFO)
+    char *head;
+#elif defined(MM_INSERT_ADDR)
+    char *eprev, *e;
+    int i;
+#endif
+
+    occ_free -= SIZE(HDR(ptr));
+    occ_nfree--;
+    if (SIZE(HDR(ptr)) >= TREESIZE) {
+        tree_remove(ptr);
+        return;
+    }
+#ifdef MM_INSERT_ADDR
+    if (GET(HDR(ptr)) & EXPRESS) {
+        // the lane is singly linked, so find the lane predecessor
+        i = class_index(SIZE(HDR(ptr)));
+        eprev = NULL;
+        e = eheads[i];
+        while (e != (char *)ptr) {
+            eprev = e;
+            e = (char *)UNLINK(GET(EXPR(e)));
+        }
+        e = (char *)UNLINK(GET(EXPR(ptr)));
+        if (eprev != NULL) {
+            SET(EXPR(eprev), LINK(e));
+        } else {
+            eheads[i] = e;
+        }
+        SET(HDR(ptr), GET(HDR(ptr)) & ~EXPRESS);
+    }
+#endif
+    pred = (char *)UNLINK(GET(PRED(ptr)));
+    succ = (char *)UNLINK(GET(SUCC(ptr)));
+    SET(SUCC(pred), LINK(succ));
+    if (succ != NULL) {
+        SET(PRED(succ), LINK(pred));
+    }
+#ifdef MM_INSERT_FIFO
+    else {
+        // the tail left; retarget the dummy head's tail link
+        head = HEAD(class_index(SIZE(HDR(ptr))));
+        SET(PRED(head), (pred == head) ? 0 : LINK(pred));
+    }
+#endif
+}
+
+// tree key order: by block size, ties broken by address, so every
+// key is unique and a node can be splayed to the root by its own key
+
+// key (ksize, kptr) < node (t)
+#define KEY_LT(ksize, kptr, t) \
+    ((ksize) < SIZE(HDR(t)) || ((ksize) == SIZE(HDR(t)) && (kptr) < (t)))
+
+// node (t) < key (ksize, kptr)
+#define KEY_GT(ksize, kptr, t) \
+    (SIZE(HDR(t)) < (ksize) || (SIZE(HDR(t)) == (ksize) && (t) < (kptr)))
+
+/*
+ * splay - top-down splay of tree rooted at (t) around key (ksize, kptr)
+ * return new root: the key's node if present, else a neighbor of the key
+ */
+static char *splay(char *t, size_t ksize, char *kptr) {
+    char *l, *r, *y;
+
+    if (t == NULL) {
+        return NULL;
+    }
+    SET(LEFT(scratch), 0);
+    SET(RIGHT(scratch), 0);
+    l = r = scratch;
+
+    for (;;) {
+        if (KEY_LT(ksize, kptr, t)) {
+            y = (char *)UNLINK(GET(LEFT(t)));
+            if (y == NULL) {
+                break;
+            }
+            if (KEY_LT(ksize, kptr, y)) {
+                // rotate right
+                SET(LEFT(t), GET(RIGHT(y)));
+                SET(RIGHT(y), LINK(t));
+                t = y;
+                if (GET(LEFT(t)) == 0) {
+                    break;
+                }
+            }
+            // link right
+            SET(LEFT(r), LINK(t));
+            r = t;
+            t = (char *)UNLINK(GET(LEFT(t)));
+        } else if (KEY_GT(ksize, kptr, t)) {
+            y = (char *)UNLINK(GET(RIGHT(t)));
+            if (y == NULL) {
+                break;
+            }
+            if (KEY_GT(ksize, kptr, y)) {
+                // rotate left
+                SET(RIGHT(t), GET(LEFT(y)));
+                SET(LEFT(y), LINK(t));
+                t = y;
+                if (GET(RIGHT(t)) == 0) {
+                    break;
+                }
+            }
+            // link left
+            SET(RIGHT(l), LINK(t));
+            l = t;
+            t = (char *)UNLINK(GET(RIGHT(t)));
+        } else {
+            break;
+        }
+    }
+    // assemble
+    SET(RIGHT(l), GET(LEFT(t)));
+    SET(LEFT(r), GET(RIGHT(t)));
+    SET(LEFT(t), GET(RIGHT(scratch)));
+    SET(RIGHT(t), GET(LEFT(scratch)));
+    return t;
+}
+
+/*
+ * tree_insert - insert large free block into the splay tree
+ */
+static void tree_insert(char *ptr) {
+    size_t size = SIZE(HDR(ptr));
+
+    if (root == NULL) {
+        SET(LEFT(ptr), 0);
+        SET(RIGHT(ptr), 0);
+        root = ptr;
+        return;
+    }
+    root = splay(root, size, ptr);
+    if (KEY_LT(size, ptr, root)) {
+        SET(LEFT(ptr), GET(LEFT(root)));
+        SET(RIGHT(ptr), LINK(root));
+        SET(LEFT(root), 0);
+    } else {
+        SET(RIGHT(ptr), GET(RIGHT(root)));
+        SET(LEFT(ptr), LINK(root));
+        SET(RIGHT(root), 0);
+    }
+    root = ptr;
+}
+
+/*
+ * tree_remove - remove large free block from the splay tree
+ */
+static void tree_remove(char *ptr) {
+    size_t size = SIZE(HDR(ptr));
+    char *left;
+
+    // splay ptr to the root, then join its subtrees
+    root = splay(root, size, ptr);
+    left = (char *)UNLINK(GET(LEFT(root)));
+    if (left == NULL) {
+        root = (char *)UNLINK(GET(RIGHT(root)));
+    } else {
+        // all of left subtree < key: splay brings its largest node up,
+        // leaving its right child empty
+        left = splay(left, size, ptr);
+        SET(RIGHT(left), GET(RIGHT(root)));
+        root = left;
+    }
+}
+
+/*
+ * tree_fit - choose best fit free block from the splay tree
+ * return free block pointer on success, NULL if no fit
+ */
+static char *tree_fit(size_t asize) {
+    char *t = root, *best = NULL;
+
+    while (t != NULL) {
+        if (SIZE(HDR(t)) >= asize) {
+            best = t;
+            t = (char *)UNLINK(GET(LEFT(t)));
+        } else {
+            t = (char *)UNLINK(GET(RIGHT(t)));
+        }
+    }
+    return best;
+}
+
+/*
+ * stats_arena - add the bound arena's occupancy to (st): counters,
+ * per-class free block histogram, and largest free block
+ */
+static void stats_arena(mm_stats_t *st) {
+    char *ptr;
+    size_t size;
+    int i;
+
+    if (heads == NULL) {
+        return;
+    }
+    st->live_bytes += occ_live;
+    st->free_bytes += occ_free;
+    st->free_blocks += occ_nfree;
+    for (i = 0; i < NCLASS; i++) {
+        ptr = (char *)UNLINK(GET(SUCC(HEAD(i))));
+        while (ptr != NULL) {
+            size = SIZE(HDR(ptr));
+            st->class_blocks[i]++;
+            if (size > st->largest_free) {
+                st->largest_free = size;
+            }
+            ptr = (char *)UNLINK(GET(SUCC(ptr)));
+        }
+    }
+    tree_stats(root, st);
+}
+
+/*
+ * tree_stats - count every tree block into (st)
+ */
+static void tree_stats(char *t, mm_stats_t *st) {
+    if (t == NULL) {
+        return;
+    }
+    st->class_blocks[NCLASS]++;
+    if (SIZE(HDR(t)) > st->largest_free) {
+        st->largest_free = SIZE(HDR(t));
+    }
+    tree_stats((char *)UNLINK(GET(LEFT(t))), st);
+    tree_stats((char *)UNLINK(GET(RIGHT(t))), st);
+}
+
+/*
+ * find_fit - choose best fit free block, searching small size classes
+ * from the matching class upward, then the splay tree
+ * return free block pointer on success, NULL if no fit
+ */
+static void *find_fit(size_t asize) {
+    char *ptr, *next, *best;
+    size_t size, bestsize;
+    int i;
+
+    for (i = class_index(asize); i < NCLASS; i++) {
+        best = NULL;
+        bestsize = 0;
+        ptr = (char *)UNLINK(GET(SUCC(HEAD(i))));
+        while (ptr != NULL) {
+            // the walk is a dependent pointer chase, so start the next
+            // node's load while this one is examined; its header sits
+            // on the same line as its links (4 bytes below the payload)
+            next = (char *)UNLINK(GET(SUCC(ptr)));
+            __builtin_prefetch(HDR(next));
+            size = SIZE(HDR(ptr));
+            if (size == asize) {
+                return ptr;
+            }
+            if (size >= asize && (best == NULL || size < bestsize)) {
+                best = ptr;
+                bestsize = size;
+            }
+            ptr = next;
+        }
+        if (best != NULL) {
+            return best;
+        }
+    }
+    return tree_fit(asize);
+}
+
+/*
+ * extend_heap - extend heap enough to serve (asize) bytes
+ * return coalesced free block pointer on success, NULL on fail
+ */
+static void *extend_heap(size_t asize) {
+    size_t exsize;
+    char *oldbrk;
+#ifdef MM_THREADSAFE
+    char *ptr;
+#else
+    char *ptr, *hw, *lo;
+#endif
+
+    exsize = (asize > grow_next) ? asize : grow_next;
+
+    // allocation velocity: extending while the lists are nearly empty
+    // doubles the next extension, but never past a sixteenth of the
+    // arena's footprint, so overshoot at the top of a ramp stays
+    // bounded; arriving with ample free space on hand decays it
+    // (see MM_GROW_MAX)
+    if (occ_free < exsize / 4 && (grow_next << 4) < occ_live + occ_free) {
+        if (grow_next < MM_GROW_MAX) {
+            grow_next <<= 1;
+        }
+    } else if (grow_next > CHUNKSIZE) {
+        grow_next >>= 1;
+    }
+#ifdef MM_THREADSAFE
+    // each extension is a self-contained chunk: a forced previous-
+    // allocated bit and a terminator header frame the new block, so
+    // coalescing never reaches into another arena's chunks
+    if ((oldbrk = mem_sbrk(exsize + DWSIZE)) == (void *)-1) {
+        // the adaptive size can overshoot the space left: retry with
+        // just what the request needs before giving up
+        exsize = (asize > CHUNKSIZE) ? asize : CHUNKSIZE;
+        grow_next = CHUNKSIZE;
+        if ((oldbrk = mem_sbrk(exsize + DWSIZE)) == (void *)-1) {
+            return NULL;
+        }
+    }
+    ptr = oldbrk + DWSIZE;
+    SET(HDR(ptr), PACK(exsize, FREE) | PALLOC);
+    SET(FTR(ptr), PACK(exsize, FREE));
+    SET(HDR(NEXT(ptr)), PACK(0, ALLOCATED));
+    SET_OWNER(ptr);
+    insert_block(ptr);
+
+    return ptr;
+#else
+    hw = heap_base + mem_heap_hiwater();
+    if ((oldbrk = mem_sbrk(exsize)) == (void *)-1) {
+        // the adaptive size can overshoot the space left: retry with
+        // just what the request needs before giving up
+        exsize = (asize > CHUNKSIZE) ? asize : CHUNKSIZE;
+        grow_next = CHUNKSIZE;
+        if ((oldbrk = mem_sbrk(exsize)) == (void *)-1) {
+            return NULL;
+        }
+    }
+    // old epilogue header becomes the new block's header; keep its
+    // cached previous-block status
+    SET(HDR(oldbrk), PACK(exsize, FREE) | PREV_ALLOC(HDR(oldbrk)));
+    SET(FTR(oldbrk), PACK(exsize, FREE));
+    SET(HDR(NEXT(oldbrk)), PACK(0, ALLOCATED));
+
+    lo = clean_lo;
+    ptr = coalesce(oldbrk);
+    if (ptr != oldbrk) {
+        // the merge left the old top block's footer and the old
+        // epilogue dead mid-block: scrub them so the virgin band
+        // below stays all-zero (coalesce dirtied the band for this
+        // merge, but the scrub makes it the one safe exception)
+        SET(oldbrk - DWSIZE, 0);
+        SET(HDR(oldbrk), 0);
+    }
 
-    } else if (prev_alloc && !next_alloc) {     // next is free
-        // merge ptr and next
+    // track the virgin band for mm_calloc. bytes above the old
+    // high-water mark have never been written; trimmed-and-regrown
+    // memory below it may hold stale data outside decommitted pages
+    if (oldbrk >= hw) {
+        clean_lo = (clean_hi == oldbrk) ? lo : oldbrk;
+        clean_hi = oldbrk + exsize;
+    } else if (hw < oldbrk + exsize) {
+        clean_lo = hw;
+        clean_hi = oldbrk + exsize;
+    }
+
+    return ptr;
+#endif
+}
+
+/*
+ * alloc_block - allocate a block of (asize) bytes from the free
+ * lists, extending the heap if necessary
+ * return allocated block pointer on success, NULL on fail
+ */
+static void *alloc_block(size_t asize) {
+    char *ptr;
+
+    // choose fit free block; if no fit found, extend heap
+    if ((ptr = find_fit(asize)) == NULL) {
+#ifdef MM_DEFER_COALESCE
+        // merge deferred free blocks before growing the heap
+        sweep();
+        ptr = find_fit(asize);
+    }
+    if (ptr == NULL) {
+#endif
+#ifdef MM_THREADSAFE
+        // adopt remotely freed blocks before growing the heap
+        if (drain_remote() > 0) {
+            ptr = find_fit(asize);
+        }
+    }
+    if (ptr == NULL) {
+#endif
+        if ((ptr = extend_heap(asize)) == NULL) {
+            return NULL;
+        }
+    }
+    place(ptr, asize);
+    CHECK_BLOCK(ptr);
+
+    return ptr;
+}
+
+/*
+ * mmap_alloc - serve a block of (asize) bytes from a dedicated
+ * mem_map chunk outside the sbrk heap (see MM_MMAP_THRESH)
+ * return allocated block pointer on success, NULL on fail
+ */
+static void *mmap_alloc(size_t asize) {
+    size_t pagesize = mem_pagesize();
+    size_t maplen = (asize + DWSIZE + pagesize - 1) & ~(pagesize - 1);
+    char *ptr;
+
+    if ((ptr = mem_map(maplen)) == NULL) {
+        return NULL;
+    }
+    // the payload sits one DWSIZE in, leaving room for the header
+    // (and the owner word); the size field keeps the usable block
+    // size, so the map length is recovered as SIZE + DWSIZE on free
+    ptr += DWSIZE;
+    SET(HDR(ptr), PACK(maplen - DWSIZE, ALLOCATED) | PALLOC);
+    SET_OWNER(ptr);
+    occ_live += maplen - DWSIZE;
+
+    return ptr;
+}
+
+/*
+ * free_block - mark allocated block at (ptr) free and return it to
+ * the free lists, coalescing immediately or deferring to a sweep
+ */
+static void free_block(void *ptr) {
+    size_t size = SIZE(HDR(ptr));
+
+#ifdef MM_HARDEN_GUARD
+    // coalescing and the free-list links write inside the block, so
+    // drop any guard page first
+    if (size >= HARDEN_GUARDSIZE) {
+        mem_unguard(ptr, (char *)ptr + size);
+    }
+#endif
+#ifndef MM_THREADSAFE
+    // the freed payload may hold user data: nothing at or below its
+    // end is virgin for mm_calloc anymore
+    if ((char *)ptr + size > clean_lo && (char *)ptr < clean_hi) {
+        clean_lo = (char *)ptr + size;
+    }
+#endif
+    occ_live -= size;
+    SET(HDR(ptr), PACK(size, FREE) | PREV_ALLOC(HDR(ptr)));
+    SET(FTR(ptr), PACK(size, FREE));
+#ifdef MM_DEFER_COALESCE
+    insert_block(ptr);
+    SET(HDR(NEXT(ptr)), GET(HDR(NEXT(ptr))) & ~PALLOC);
+    CHECK_BLOCK(ptr);
+    if (++nfreed >= SWEEPTHRESH) {
+        sweep();
+#ifndef MM_THREADSAFE
+        // sweep may have merged (ptr) into a predecessor, leaving a
+        // stale header that would fool trim_top's guards: trim the
+        // block that really sits under the epilogue, if it is free
+        ptr = (char *)mem_heap_hi() + 1;
+        if (PREV_ALLOC(HDR(ptr))) {
+            return;
+        }
+        ptr = PREV(ptr);
+#endif
+    }
+#else
+    ptr = coalesce(ptr);
+#endif
+#ifndef MM_THREADSAFE
+    trim_top(ptr);
+#endif
+#ifndef MM_DEFER_COALESCE
+    CHECK_BLOCK(ptr);
+#endif
+}
+
+/*
+ * place - allocate (asize) bytes in free block at (ptr),
+ * splitting off the remainder if it is large enough
+ */
+static void place(void *ptr, size_t asize) {
+    size_t fsize;
+    char *newfree;
+
+    // modify asize to avoid block smaller than MINSIZE
+    fsize = SIZE(HDR(ptr));
+    if (fsize - asize < MINSIZE) {
+        asize = fsize;
+    }
+
+    // remove block from free list and set header (no footer on
+    // allocated blocks)
+    remove_block(ptr);
+    SET(HDR(ptr), PACK(asize, ALLOCATED) | PREV_ALLOC(HDR(ptr)));
+    occ_live += asize;
+
+    // create remaining free block if it exists,
+    // else mark this block allocated in the next header
+    if (asize < fsize) {
+        newfree = NEXT(ptr);
+        SET(HDR(newfree), PACK(fsize - asize, FREE) | PALLOC);
+        SET(FTR(newfree), PACK(fsize - asize, FREE));
+        SET_OWNER(newfree);
+        coalesce(newfree);
+    } else {
+        SET(HDR(NEXT(ptr)), GET(HDR(NEXT(ptr))) | PALLOC);
+    }
+}
+
+#ifndef MM_THREADSAFE
+/*
+ * trim_top - release the excess of an oversized free block at the
+ * top of the heap back to the OS, keeping CHUNKSIZE of it
+ */
+static void trim_top(void *ptr) {
+    size_t size = SIZE(HDR(ptr));
+
+    if (size <= MM_TRIM_THRESH || SIZE(HDR(NEXT(ptr))) != 0) {
+        return;
+    }
+    remove_block(ptr);
+    if (mem_sbrk(-(int)(size - CHUNKSIZE)) == (void *)-1) {
+        insert_block(ptr);
+        return;
+    }
+    SET(HDR(ptr), PACK(CHUNKSIZE, FREE) | PREV_ALLOC(HDR(ptr)));
+    SET(FTR(ptr), PACK(CHUNKSIZE, FREE));
+    SET(HDR(NEXT(ptr)), PACK(0, ALLOCATED));
+    insert_block(ptr);
+    if (clean_hi > (char *)ptr + CHUNKSIZE) {
+        clean_hi = (char *)ptr + CHUNKSIZE;
+    }
+    // giving memory back is the strongest sign growth overshot
+    grow_next = CHUNKSIZE;
+    mem_decommit((char *)ptr + CHUNKSIZE, (char *)ptr + size);
+}
+#endif
+
+/*
+ * coalesce - merge adjacent free blocks & modify free lists
+ * return merged block pointer
+ */
+static void *coalesce(void *ptr) {
+    char *prev, *next;
+    size_t prev_alloc, next_alloc, size;
+
+    next = NEXT(ptr);
+    prev_alloc = PREV_ALLOC(HDR(ptr));
+    next_alloc = ALLOC(HDR(next));
+    size = SIZE(HDR(ptr));
+
+    // merge with free neighbors
+    // merged size may cross a class boundary, so neighbors leave their
+    // lists and the merged block is reinserted into the matching class
+    if (!next_alloc) {
+        remove_block(next);
         size += SIZE(HDR(next));
-        SET(HDR(ptr), PACK(size, FREE));
-        SET(FTR(ptr), PACK(size, FREE));
+    }
+    if (!prev_alloc) {
+        prev = PREV(ptr);
+        remove_block(prev);
+        size += SIZE(HDR(prev));
+        ptr = prev;
+    }
+    SET(HDR(ptr), PACK(size, FREE) | PREV_ALLOC(HDR(ptr)));
+    SET(FTR(ptr), PACK(size, FREE));
+    insert_block(ptr);
+
+#ifndef MM_THREADSAFE
+    // a merge strands the old interior headers, footers and list
+    // links mid-block, so the merged extent is no longer virgin
+    if ((!next_alloc || !prev_alloc) &&
+        (char *)ptr + size > clean_lo && (char *)ptr < clean_hi) {
+        clean_lo = (char *)ptr + size;
+    }
+#endif
+
+    // mark this block free in the next header
+    SET(HDR(NEXT(ptr)), GET(HDR(NEXT(ptr))) & ~PALLOC);
+
+    return ptr;
+}
+
+#ifdef MM_DEFER_COALESCE
+/*
+ * sweep - walk the heap and merge every run of adjacent free blocks
+ */
+static void sweep(void) {
+    char *ptr, *next;
+    size_t size;
+
+    // first block sits right after the prologue (heads points to the
+    // prologue payload)
+    for (ptr = NEXT(heads); SIZE(HDR(ptr)) > 0; ptr = NEXT(ptr)) {
+        if (ALLOC(HDR(ptr))) {
+            continue;
+        }
+        while (!ALLOC(HDR(NEXT(ptr)))) {
+            next = NEXT(ptr);
+            remove_block(ptr);
+            remove_block(next);
+            size = SIZE(HDR(ptr)) + SIZE(HDR(next));
+            SET(HDR(ptr), PACK(size, FREE) | PREV_ALLOC(HDR(ptr)));
+            SET(FTR(ptr), PACK(size, FREE));
+            insert_block(ptr);
+#ifndef MM_THREADSAFE
+            // merged runs carry stranded metadata words (see coalesce)
+            if ((char *)ptr + size > clean_lo && ptr < clean_hi) {
+                clean_lo = (char *)ptr + size;
+            }
+#endif
+        }
+    }
+    nfreed = 0;
+}
+#endif
+
+#ifdef MM_SLAB
+/*
+ * slab_alloc - allocate one object of (osize) bytes from its pool
+ * return object pointer on success, NULL if no slab could be created
+ */
+static void *slab_alloc(size_t osize) {
+    int pool = osize / DWSIZE - 1;
+    char *base, *succ;
+    slab_t *sp;
+    int w, b;
 
-        // remove next from free list
-        pred = (char *)GET(PRED(next));
-        succ = (char *)GET(SUCC(next));
-        SET(SUCC(pred), (int)succ);
+    if ((base = slabpool[pool]) == NULL) {
+        if ((base = slab_create(osize)) == NULL) {
+            return NULL;
+        }
+    }
+    sp = (slab_t *)base;
+
+    // find and claim a set (free) bitmap bit
+    for (w = 0; sp->bitmap[w] == 0; w++)
+        ;
+    b = 0;
+    while ((sp->bitmap[w] & (1u << b)) == 0) {
+        b++;
+    }
+    sp->bitmap[w] &= ~(1u << b);
+
+    // a full slab leaves its pool's partial list
+    if (--sp->nfree == 0) {
+        succ = (char *)UNLINK(sp->succ);
+        slabpool[pool] = succ;
         if (succ != NULL) {
-            SET(PRED(succ), (int)pred);
+            ((slab_t *)succ)->pred = 0;
         }
+    }
+    return SLABOBJ(base) + (w * 32 + b) * osize;
+}
 
-        // insert ptr to free list
-        first = (char *)GET(SUCC(head));
-        SET(SUCC(head), (int)ptr);
-        SET(PRED(ptr), (int)head);
-        SET(SUCC(ptr), (int)first);
-        if (first != NULL) {
-            SET(PRED(first), (int)ptr);
+/*
+ * slab_free - free slab object at (ptr) in the slab of page (idx)
+ */
+static void slab_free(void *ptr, int idx) {
+    char *base = (char *)mem_heap_lo() + idx * CHUNKSIZE;
+    slab_t *sp = (slab_t *)base;
+    char *pred, *succ;
+    int pool, i;
+
+    pool = sp->osize / DWSIZE - 1;
+    i = ((char *)ptr - SLABOBJ(base)) / sp->osize;
+    sp->bitmap[i / 32] |= 1u << (i % 32);
+    sp->nfree++;
+
+    // a previously full slab rejoins its pool's partial list
+    if (sp->nfree == 1) {
+        succ = slabpool[pool];
+        sp->pred = 0;
+        sp->succ = LINK(succ);
+        if (succ != NULL) {
+            ((slab_t *)succ)->pred = LINK(base);
         }
-        return ptr;
+        slabpool[pool] = base;
+    }
 
-    } else if (!prev_alloc && next_alloc) {     // prev is free
-        // merge prev and ptr
-        size += SIZE(HDR(prev));
-        SET(HDR(prev), PACK(size, FREE));
-        SET(FTR(prev), PACK(size, FREE));
-        return prev;
-    } else {                                    // both are free
-        // merge prev, ptr, and next
-        size += SIZE(HDR(prev)) + SIZE(HDR(next));
-        SET(HDR(prev), PACK(size, FREE));
-        SET(FTR(prev), PACK(size, FREE));
-
-        // remove next from free list
-        pred = (char *)GET(PRED(next));
-        succ = (char *)GET(SUCC(next));
-        SET(SUCC(pred), (int)succ);
+    // a fully free slab goes back to the general allocator
+    if (sp->nfree == NOBJ(sp->osize)) {
+        pred = (char *)UNLINK(sp->pred);
+        succ = (char *)UNLINK(sp->succ);
+        if (pred != NULL) {
+            ((slab_t *)pred)->succ = LINK(succ);
+        } else {
+            slabpool[pool] = succ;
+        }
         if (succ != NULL) {
-            SET(PRED(succ), (int)pred);
+            ((slab_t *)succ)->pred = LINK(pred);
+        }
+        slabmap[idx] = 0;
+        free_block(base);
+    }
+}
+
+/*
+ * slab_create - carve a new slab page for objects of (osize) bytes
+ * and link it into its pool
+ * return slab base pointer on success, NULL on fail
+ *
+ * the slab occupies one whole CHUNKSIZE-granular page of the heap
+ * (so mm_free can detect membership from the address alone) and is
+ * framed as an allocated block, keeping the heap walkable. the gap
+ * between the old heap top and the page boundary becomes a free block.
+ */
+static char *slab_create(size_t osize) {
+    size_t off, base_off, pad;
+    char *oldbrk, *base;
+    slab_t *sp;
+    int pool, nobj, i;
+
+    // next page boundary leaving room for the gap free block
+    off = mem_heapsize();
+    base_off = ((off + MINSIZE + CHUNKSIZE - 1) / CHUNKSIZE) * CHUNKSIZE;
+    if ((oldbrk = mem_sbrk(base_off + CHUNKSIZE - off)) == (void *)-1) {
+        return NULL;
+    }
+    base = (char *)mem_heap_lo() + base_off;
+
+    // gap free block between the old epilogue and the slab block
+    pad = base_off - off;
+    SET(HDR(oldbrk), PACK(pad, FREE) | PREV_ALLOC(HDR(oldbrk)));
+    SET(FTR(oldbrk), PACK(pad, FREE));
+
+    // slab block header and new epilogue
+    SET(HDR(base), PACK(CHUNKSIZE, ALLOCATED));
+    SET(HDR(NEXT(base)), PACK(0, ALLOCATED) | PALLOC);
+    occ_live += CHUNKSIZE;
+    coalesce(oldbrk);
+
+    // initialize descriptor: all objects free
+    sp = (slab_t *)base;
+    nobj = NOBJ(osize);
+    sp->osize = osize;
+    sp->nfree = nobj;
+    memset(sp->bitmap, 0, sizeof(sp->bitmap));
+    for (i = 0; i < nobj; i++) {
+        sp->bitmap[i / 32] |= 1u << (i % 32);
+    }
+
+    pool = osize / DWSIZE - 1;
+    sp->pred = 0;
+    sp->succ = LINK(slabpool[pool]);
+    if (slabpool[pool] != NULL) {
+        ((slab_t *)slabpool[pool])->pred = LINK(base);
+    }
+    slabpool[pool] = base;
+    slabmap[base_off / CHUNKSIZE] = 1;
+
+    return base;
+}
+#endif
+
+#ifdef MM_HARDEN
+/*
+ * harden_init - draw fresh secrets for the link encoding and the
+ * block canaries; /dev/urandom, with a clock/address mix as fallback
+ */
+static void harden_init(void) {
+    unsigned int seed[2];
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, seed, sizeof(seed)) != sizeof(seed)) {
+        seed[0] = (unsigned int)time(NULL) * 2654435761u;
+        seed[1] = (unsigned int)(size_t)&fd * 2654435761u;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    link_secret = seed[0] | 0x80000000;     // see the LINK macro
+    canary_secret = seed[1];
+}
+
+/*
+ * harden_check - verify the canary of allocated block (ptr) before it
+ * is freed or resized; a smashed canary means something wrote past
+ * the end of the payload
+ */
+static void harden_check(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (GET(FTR(ptr)) != CANARY(ptr)) {
+        fprintf(stderr, "mm harden: canary smashed (block %p)\n", ptr);
+        abort();
+    }
+}
+#endif /* MM_HARDEN */
+
+#ifdef MM_CHECK
+/*
+ * check_fail - report a consistency failure and abort
+ */
+static void check_fail(const char *msg, void *ptr) {
+    fprintf(stderr, "mm check: %s (block %p, header 0x%x)\n",
+            msg, ptr, (ptr == NULL) ? 0 : GET(HDR(ptr)));
+    abort();
+}
+
+/*
+ * check_block - incremental validator: check the invariants of the
+ * block the current operation touched, and of its next neighbor
+ */
+static void check_block(void *ptr) {
+    size_t size = SIZE(HDR(ptr));
+    char *next, *pred, *succ;
+
+    if (((size_t)ptr) % DWSIZE != 0) {
+        check_fail("misaligned block", ptr);
+    }
+    if (size < MINSIZE) {
+        check_fail("undersized block", ptr);
+    }
+    next = NEXT(ptr);
+    if (ALLOC(HDR(ptr))) {
+        if (!PREV_ALLOC(HDR(next))) {
+            check_fail("next header misses the prev-allocated bit", ptr);
+        }
+    } else {
+        if (GET(FTR(ptr)) != PACK(size, FREE)) {
+            check_fail("header/footer mismatch", ptr);
+        }
+        if (PREV_ALLOC(HDR(next))) {
+            check_fail("next header claims an allocated prev", ptr);
+        }
+#ifndef MM_DEFER_COALESCE
+        if (!ALLOC(HDR(next)) && SIZE(HDR(next)) != 0) {
+            check_fail("adjacent free blocks", ptr);
+        }
+        if (!PREV_ALLOC(HDR(ptr))) {
+            check_fail("adjacent free blocks", ptr);
+        }
+#endif
+        // list link symmetry; tree nodes are covered by mm_check
+        if (size < TREESIZE) {
+            pred = (char *)UNLINK(GET(PRED(ptr)));
+            succ = (char *)UNLINK(GET(SUCC(ptr)));
+            if (pred == NULL) {
+                check_fail("free block not linked", ptr);
+            }
+            if ((char *)UNLINK(GET(SUCC(pred))) != (char *)ptr) {
+                check_fail("pred/succ asymmetry", ptr);
+            }
+            if (succ != NULL &&
+                (char *)UNLINK(GET(PRED(succ))) != (char *)ptr) {
+                check_fail("succ/pred asymmetry", ptr);
+            }
+        }
+    }
+    if (SIZE(HDR(next)) == 0 && !ALLOC(HDR(next))) {
+        check_fail("epilogue clobbered", ptr);
+    }
+}
+
+/*
+ * check_tree_walk - validate and count the tree rooted at (t): every
+ * node marked free, footer intact, large enough for the tree
+ */
+static size_t check_tree_walk(char *t, size_t *bytes) {
+    size_t size;
+
+    if (t == NULL) {
+        return 0;
+    }
+    size = SIZE(HDR(t));
+    if (ALLOC(HDR(t))) {
+        check_fail("allocated block in the tree", t);
+    }
+    if (size < TREESIZE) {
+        check_fail("undersized tree block", t);
+    }
+    if (GET(FTR(t)) != PACK(size, FREE)) {
+        check_fail("header/footer mismatch in the tree", t);
+    }
+    *bytes += size;
+    return 1 + check_tree_walk((char *)UNLINK(GET(LEFT(t))), bytes)
+             + check_tree_walk((char *)UNLINK(GET(RIGHT(t))), bytes);
+}
+
+/*
+ * check_arena - validate the bound arena's free lists and tree, and
+ * cross-check them against the incremental occupancy counters
+ */
+static void check_arena(void) {
+    char *ptr, *prev;
+    size_t size, nfree = 0, bytes = 0;
+    int i;
+
+    for (i = 0; i < NCLASS; i++) {
+        prev = HEAD(i);
+        ptr = (char *)UNLINK(GET(SUCC(prev)));
+        while (ptr != NULL) {
+            size = SIZE(HDR(ptr));
+            if (ALLOC(HDR(ptr))) {
+                check_fail("allocated block in a free list", ptr);
+            }
+            if (class_index(size) != i || size >= TREESIZE) {
+                check_fail("block in the wrong size class", ptr);
+            }
+            if ((char *)UNLINK(GET(PRED(ptr))) != prev) {
+                check_fail("pred/succ asymmetry", ptr);
+            }
+#ifdef MM_INSERT_ADDR
+            if (prev != HEAD(i) && ptr < prev) {
+                check_fail("free list out of address order", ptr);
+            }
+#endif
+            nfree++;
+            bytes += size;
+            prev = ptr;
+            ptr = (char *)UNLINK(GET(SUCC(ptr)));
         }
-        return prev;
     }
+    nfree += check_tree_walk(root, &bytes);
+    if (nfree != occ_nfree) {
+        check_fail("free block count disagrees with the counters", NULL);
+    }
+    if (bytes != occ_free) {
+        check_fail("free byte total disagrees with the counters", NULL);
+    }
+}
+
+/*
+ * mm_check - full consistency sweep: walk every free list and the
+ * tree of each arena against the occupancy counters, and (without
+ * per-thread arenas, where the heap is one linear run of blocks) walk
+ * the heap block by block up to the epilogue
+ * return 1 if the heap is consistent; inconsistencies abort
+ */
+int mm_check(void) {
+#ifdef MM_THREADSAFE
+    int i;
+
+    for (i = 0; i < narena && i < MM_MAXARENA; i++) {
+        cur = &arenas[i];
+        pthread_mutex_lock(&cur->lock);
+        if (heads != NULL) {
+            check_arena();
+        }
+        pthread_mutex_unlock(&cur->lock);
+    }
+#else
+    char *ptr;
+    size_t nfree = 0;
+#ifndef MM_DEFER_COALESCE
+    int prevfree = 0;
+#endif
+
+    if (heads == NULL) {
+        return 1;
+    }
+    for (ptr = NEXT(heads); SIZE(HDR(ptr)) > 0; ptr = NEXT(ptr)) {
+        if (((size_t)ptr) % DWSIZE != 0) {
+            check_fail("misaligned block", ptr);
+        }
+        if (!ALLOC(HDR(ptr))) {
+            if (GET(FTR(ptr)) != PACK(SIZE(HDR(ptr)), FREE)) {
+                check_fail("header/footer mismatch", ptr);
+            }
+#ifndef MM_DEFER_COALESCE
+            if (prevfree) {
+                check_fail("adjacent free blocks", ptr);
+            }
+#endif
+            nfree++;
+        }
+        if ((ALLOC(HDR(ptr)) != 0) != (PREV_ALLOC(HDR(NEXT(ptr))) != 0)) {
+            check_fail("stale prev-allocated bit", ptr);
+        }
+#ifndef MM_DEFER_COALESCE
+        prevfree = !ALLOC(HDR(ptr));
+#endif
+    }
+    if (!ALLOC(HDR(ptr))) {
+        check_fail("epilogue clobbered", ptr);
+    }
+    if (nfree != occ_nfree) {
+        check_fail("free block count disagrees with the counters", NULL);
+    }
+    check_arena();
+#endif
+    return 1;
+}
+#endif /* MM_CHECK */
+
+#ifdef MM_TRACE
+/*
+ * trace_event - append one record to the event ring
+ */
+static void trace_event(int op, size_t size, void *ptr) {
+    unsigned int idx;
+
+#ifdef MM_THREADSAFE
+    idx = __sync_fetch_and_add(&trace_head, 1) % MM_TRACE_CAP;
+#else
+    idx = trace_head++ % MM_TRACE_CAP;
+#endif
+    trace_ring[idx].op = op;
+    trace_ring[idx].size = (unsigned int)size;
+    trace_ring[idx].ofs = LINK(ptr);
+}
+
+/*
+ * trace_event_pair - append a realloc record and its TR_MOVED partner
+ * in two adjacent slots, so concurrent appends cannot split the pair
+ */
+static void trace_event_pair(size_t size, void *oldptr, void *newptr) {
+    unsigned int idx;
+
+#ifdef MM_THREADSAFE
+    idx = __sync_fetch_and_add(&trace_head, 2);
+#else
+    idx = trace_head;
+    trace_head += 2;
+#endif
+    trace_ring[idx % MM_TRACE_CAP].op = TR_REALLOC;
+    trace_ring[idx % MM_TRACE_CAP].size = (unsigned int)size;
+    trace_ring[idx % MM_TRACE_CAP].ofs = LINK(oldptr);
+    idx++;
+    trace_ring[idx % MM_TRACE_CAP].op = TR_MOVED;
+    trace_ring[idx % MM_TRACE_CAP].size = 0;
+    trace_ring[idx % MM_TRACE_CAP].ofs = LINK(newptr);
+}
+
+/*
+ * trace_map_slot - open-addressing slot for heap offset (key) in the
+ * dump-time offset-to-id map; offset 0 marks an empty slot
+ */
+static unsigned int trace_map_slot(unsigned int *keys, unsigned int mask,
+                                   unsigned int key) {
+    unsigned int i = (key * 2654435761u) & mask;
+
+    while (keys[i] != 0 && keys[i] != key) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/*
+ * trace_pass - run over the captured window once, assigning dense
+ * block ids in event order; writes .rep request lines when (fp) is
+ * set. events on blocks that fell out of the window are dropped (a
+ * windowed realloc replays as a fresh allocation), so the result
+ * always replays standalone.
+ */
+static void trace_pass(FILE *fp, unsigned int *keys, int *vals,
+                       unsigned int mask, int *nids, int *nops) {
+    unsigned int lo, n, i, s;
+    trace_rec_t *r, *m;
+    int id;
+
+    n = (trace_head < MM_TRACE_CAP) ? trace_head : MM_TRACE_CAP;
+    lo = trace_head - n;
+    *nids = 0;
+    *nops = 0;
+    for (i = 0; i < n; i++) {
+        r = &trace_ring[(lo + i) % MM_TRACE_CAP];
+        switch (r->op & ((1 << TR_ALIGNSHIFT) - 1)) {
+        case TR_ALLOC:
+            s = trace_map_slot(keys, mask, r->ofs);
+            keys[s] = r->ofs;
+            vals[s] = (*nids)++;
+            if (fp != NULL) {
+                if (r->op >> TR_ALIGNSHIFT) {
+                    fprintf(fp, "m %d %u %u\n", vals[s],
+                            1u << (r->op >> TR_ALIGNSHIFT), r->size);
+                } else {
+                    fprintf(fp, "a %d %u\n", vals[s], r->size);
+                }
+            }
+            (*nops)++;
+            break;
+
+        case TR_REALLOC:
+            if (i + 1 >= n) {
+                break;          // partner not appended yet
+            }
+            m = &trace_ring[(lo + ++i) % MM_TRACE_CAP];
+            s = trace_map_slot(keys, mask, r->ofs);
+            if (r->ofs != 0 && keys[s] != 0 && vals[s] >= 0) {
+                id = vals[s];
+                if (fp != NULL) {
+                    fprintf(fp, "r %d %u\n", id, r->size);
+                }
+            } else {
+                // the allocation fell out of the window
+                id = (*nids)++;
+                if (fp != NULL) {
+                    fprintf(fp, "a %d %u\n", id, r->size);
+                }
+            }
+            s = trace_map_slot(keys, mask, m->ofs);
+            keys[s] = m->ofs;
+            vals[s] = id;
+            (*nops)++;
+            break;
+
+        case TR_FREE:
+            s = trace_map_slot(keys, mask, r->ofs);
+            if (keys[s] != 0 && vals[s] >= 0) {
+                if (fp != NULL) {
+                    fprintf(fp, "f %d\n", vals[s]);
+                }
+                vals[s] = -1;   // dead: the offset may be recycled
+                (*nops)++;
+            }
+            break;
+
+        default:                // TR_MOVED whose partner was windowed
+            break;
+        }
+    }
+}
+
+/*
+ * mm_trace_dump - write the captured event window to (path) as a .rep
+ * trace: the four header lines (suggested heap size, distinct ids,
+ * requests, weight) followed by one request per line, exactly what
+ * mdriver's read_trace consumes
+ * return 0 on success, -1 on fail
+ */
+int mm_trace_dump(const char *path) {
+    FILE *fp;
+    unsigned int *keys;
+    int *vals;
+    unsigned int mask, n;
+    int nids, nops;
+
+    n = (trace_head < MM_TRACE_CAP) ? trace_head : MM_TRACE_CAP;
+    mask = 2;
+    while (mask < 2 * n + 2) {
+        mask <<= 1;
+    }
+    keys = (unsigned int *)calloc(mask, sizeof(unsigned int));
+    vals = (int *)calloc(mask, sizeof(int));
+    if (keys == NULL || vals == NULL || (fp = fopen(path, "w")) == NULL) {
+        free(keys);
+        free(vals);
+        return -1;
+    }
+    mask--;
+
+    // count ids and requests first, then write the header and the
+    // request lines in a second, identically-seeded pass
+    trace_pass(NULL, keys, vals, mask, &nids, &nops);
+    fprintf(fp, "%lu\n%d\n%d\n%d\n",
+            (unsigned long)mem_heap_hiwater(), nids, nops, 1);
+    memset(keys, 0, (mask + 1) * sizeof(unsigned int));
+    trace_pass(fp, keys, vals, mask, &nids, &nops);
+
+    free(keys);
+    free(vals);
+    return (fclose(fp) == EOF) ? -1 : 0;
 }
+#endif /* MM_TRACE */
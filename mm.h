@@ -4,6 +4,45 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+
+/* allocate or free (n) blocks in one call; mm_malloc_batch serves all
+   blocks from one contiguous carve and fills (out), returning 0 on
+   success and -1 on fail; mm_free_batch sorts the pointers by address
+   so adjacent blocks coalesce in one pass */
+extern int mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* heap occupancy snapshot filled in by mm_stats */
+#define MM_NCLASS 6 /* small size class lists plus the large-block tree */
+typedef struct {
+    size_t live_bytes;   /* bytes in allocated blocks, headers included */
+    size_t free_bytes;   /* bytes sitting in free blocks */
+    size_t free_blocks;  /* number of free blocks */
+    size_t largest_free; /* size of the largest free block */
+    size_t class_blocks[MM_NCLASS]; /* free blocks per class; the last
+                                       entry counts the tree */
+    size_t heap_size;    /* current heap footprint */
+    size_t heap_hiwater; /* largest heap footprint seen */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *st);
+
+/* save/restore the allocator's root state (everything outside the
+   heap image) for heap snapshots; pair with mem_save/mem_restore in
+   memlib. Restore fails on a snapshot taken by a differently
+   configured build */
+extern int mm_state_save(FILE *fp);
+extern int mm_state_restore(FILE *fp);
+
+/* write the captured allocation events as a replayable .rep trace
+   (compiled only when mm.c is built with -DMM_TRACE) */
+extern int mm_trace_dump(const char *path);
+
+/* run a full heap consistency sweep; inconsistencies print the failing
+   block and abort (compiled only when mm.c is built with -DMM_CHECK) */
+extern int mm_check(void);
 
 
 /* 
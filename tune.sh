@@ -0,0 +1,101 @@
+#!/bin/sh
+#
+# tune.sh - trace-driven auto-tuner, run via `make tune`.
+#
+# Searches the allocator's policy space over a trace set and writes
+# the best configuration by perf index to mm_tuning.h, which a build
+# with -DMM_TUNED (see `make mdriver-tuned`) picks up as defaults.
+# The search is greedy coordinate descent: each axis is swept holding
+# the others at their current best, twice, which settles the same
+# winners as the full grid in a few dozen builds instead of hundreds.
+#
+# usage: tune.sh [tracedir]
+#   tracedir defaults to traces/; a directory of .rep files captured
+#   from production with MM_TRACE and mm_trace_dump works the same.
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--Wall -O2}
+TRACEDIR=${1:-traces/}
+SRCS="mdriver.c mm.c memlib.c fsecs.c fcyc.c clock.c ftimer.c"
+
+# current best configuration (the shipped defaults)
+POLICY=LIFO
+DEFER=off
+SLAB=off
+HEADROOM=3
+MMAPTHRESH=65536
+GROWMAX=1048576
+
+flags() {
+    case $POLICY in
+	FIFO) printf ' -DMM_INSERT_FIFO';;
+	ADDR) printf ' -DMM_INSERT_ADDR';;
+    esac
+    [ $DEFER = on ] && printf ' -DMM_DEFER_COALESCE'
+    [ $SLAB = on ] && printf ' -DMM_SLAB'
+    printf ' -DMM_REALLOC_HEADROOM=%s' $HEADROOM
+    printf ' -DMM_MMAP_THRESH=%s' $MMAPTHRESH
+    printf ' -DMM_GROW_MAX=%s' $GROWMAX
+    return 0
+}
+
+# build and run the suite with the current configuration; prints the
+# perf index, or 0 when the build or run fails
+run() {
+    $CC $CFLAGS $(flags) -o mdriver-tune $SRCS 2>/dev/null || { echo 0; return; }
+    ./mdriver-tune -t "$TRACEDIR" -g 2>/dev/null | sed -n 's/^perfidx://p'
+}
+
+# sweep one axis: try each candidate with the other axes held at
+# their current best, keeping a candidate only when it strictly wins
+sweep() {
+    var=$1
+    shift
+    old=$(eval echo \$$var)
+    for v in "$@"; do
+	[ "$v" = "$old" ] && continue
+	eval $var=$v
+	s=$(run)
+	echo "  $var=$v: perfidx ${s:-0}"
+	if [ "${s:-0}" -gt "$best" ]; then
+	    best=$s
+	    old=$v
+	else
+	    eval $var=$old
+	fi
+    done
+    eval $var=$old
+}
+
+best=$(run)
+if [ "${best:-0}" -eq 0 ]; then
+    echo "tune.sh: baseline build or run failed" >&2
+    exit 1
+fi
+echo "baseline: perfidx $best ($(flags) )"
+
+for pass in 1 2; do
+    echo "pass $pass:"
+    sweep POLICY LIFO FIFO ADDR
+    sweep DEFER off on
+    sweep SLAB off on
+    sweep HEADROOM 2 3 4
+    sweep MMAPTHRESH 32768 65536 262144
+    sweep GROWMAX 65536 1048576
+done
+
+{
+    echo "/* mm_tuning.h - generated by tune.sh; do not edit."
+    echo " * perf index $best over $TRACEDIR */"
+    case $POLICY in
+	FIFO) echo "#define MM_INSERT_FIFO";;
+	ADDR) echo "#define MM_INSERT_ADDR";;
+    esac
+    [ $DEFER = on ] && echo "#define MM_DEFER_COALESCE"
+    [ $SLAB = on ] && echo "#define MM_SLAB"
+    echo "#define MM_REALLOC_HEADROOM $HEADROOM"
+    echo "#define MM_MMAP_THRESH $MMAPTHRESH"
+    echo "#define MM_GROW_MAX $GROWMAX"
+} > mm_tuning.h
+rm -f mdriver-tune
+echo "wrote mm_tuning.h: perfidx $best ($(flags) )"